@@ -7,6 +7,10 @@
 #include <linux/pid.h>
 #include <linux/random.h>
 #include <linux/btree.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include "cbtree_simd.h"
+#include "cbtree_shard.h"
 #include "calclock.h"
 
 
@@ -16,6 +20,29 @@ MODULE_DESCRIPTION("A module to create a B+ tree with the included bplus datastr
 
 // Define the size of the tree
 #define TREE_SIZE 100000000
+// Number of lookups used to compare in-node search modes
+#define SEARCH_MODE_SAMPLES 1000000
+// Number of keys handed to each cbtree_lookup_simd call
+#define SIMD_BATCH_KEYS 1024
+// Number of keys inserted per node size in the sweep mode
+#define SWEEP_SIZE 1000000
+// Number of range scans and keys per scan in the range scan profile
+#define RANGE_SCANS 1000
+#define RANGE_LEN 1000
+// Most reader threads started by the concurrent lookup profile
+#define RCU_READERS_MAX 64
+
+static bool sweep;
+module_param(sweep, bool, 0444);
+MODULE_PARM_DESC(sweep, "only run the node size sweep");
+
+static int search_pattern;
+module_param(search_pattern, int, 0444);
+MODULE_PARM_DESC(search_pattern, "keys looked up by find_tree: 0 random, 1 constant, 2 sequential");
+
+static int append_fill;
+module_param(append_fill, int, 0444);
+MODULE_PARM_DESC(append_fill, "split policy of the main cbtree for appends, see struct cbtree_head");
 
 struct kmem_cache *btree_cachep;
 struct kmem_cache *cbtree_cachep;
@@ -29,6 +56,7 @@ unsigned long search_counts[TREE_SIZE] = {0};
 
 // Fetch tree geometry
 extern struct cbtree_geo cbtree_geo32;
+extern struct cbtree_geo cbtree_geo32p;
 
 /**
  * @brief Initialized the btree
@@ -36,6 +64,7 @@ extern struct cbtree_geo cbtree_geo32;
 void create_tree(void){
 	btree_init(&btree);
 	cbtree_init(&cbtree);
+	cbtree.append_fill = append_fill;
 }
 
 KTDEF(btree_insert);
@@ -134,9 +163,16 @@ void find_tree(void){
         // Adjust the probability of generating different keys as needed
         
 		//////////////////////////////////////////////////////////
-		get_random_bytes(&key, sizeof(key));	// Random
-		// key = TREE_SIZE / 2;					// Constant
-		// key = i;								// Sequencial
+		switch (search_pattern) {
+		case 1:
+			key = TREE_SIZE / 2;				// Constant
+			break;
+		case 2:
+			key = i;							// Sequencial
+			break;
+		default:
+			get_random_bytes(&key, sizeof(key));	// Random
+		}
 		//////////////////////////////////////////////////////////
 		key %= (TREE_SIZE + 1); // Ensure the key is within the range of your tree
 		update_search_count(key);
@@ -149,26 +185,1026 @@ void find_tree(void){
 	printk(KERN_CONT "\n");
 }
 
+/**
+ * @brief compare linear and binary in-node search on the filled cbtree, reporting key comparisons and time per lookup
+*/
+void profile_search_modes(void){
+	static const struct {
+		const char *name;
+		int bsearch_pairs;
+	} modes[] = {
+		{ "linear", INT_MAX },
+		{ "binary", 0 },
+	};
+	int saved = cbtree_bsearch_pairs;
+	unsigned long i, key, compares;
+	ktime_t stopwatch[2];
+	int m;
+
+	for (m = 0; m < ARRAY_SIZE(modes); m++) {
+		cbtree_bsearch_pairs = modes[m].bsearch_pairs;
+		cbtree_keycmp_reset();
+		ktget(&stopwatch[0]);
+		for (i = 0; i < SEARCH_MODE_SAMPLES; i++) {
+			get_random_bytes(&key, sizeof(key));
+			key %= (TREE_SIZE + 1);
+			cbtree_lookup(&cbtree, &cbtree_geo32, &key);
+		}
+		ktget(&stopwatch[1]);
+		compares = cbtree_keycmp_count();
+		// zero unless built with KEYCMP_STATS=y
+		if (compares)
+			printk("cbtree %s search: %lu.%02lu compares per lookup, %lld ns per lookup\n",
+					modes[m].name,
+					compares / SEARCH_MODE_SAMPLES,
+					compares * 100 / SEARCH_MODE_SAMPLES % 100,
+					ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0])) / SEARCH_MODE_SAMPLES);
+		else
+			printk("cbtree %s search: %lld ns per lookup\n",
+					modes[m].name,
+					ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0])) / SEARCH_MODE_SAMPLES);
+	}
+	cbtree_bsearch_pairs = saved;
+}
+
+/**
+ * @brief compare the AVX2 node search with the scalar getpos on the same cache-less descent
+*/
+void profile_simd_search(void){
+	static const char * const names[] = { "scalar", "simd" };
+	int saved = cbtree_simd_enabled;
+	unsigned long *keys;
+	void **vals;
+	unsigned long i, j, found;
+	ktime_t stopwatch[2], elapsed;
+	int m;
+
+	keys = kmalloc_array(SIMD_BATCH_KEYS, sizeof(*keys), GFP_KERNEL);
+	vals = kmalloc_array(SIMD_BATCH_KEYS, sizeof(*vals), GFP_KERNEL);
+	if (!keys || !vals)
+		goto out;
+
+	for (m = 0; m < ARRAY_SIZE(names); m++) {
+		cbtree_simd_enabled = m;
+		if (m && !cbtree_simd_usable()) {
+			printk("cbtree simd search: AVX2 not available\n");
+			break;
+		}
+		elapsed = 0;
+		found = 0;
+		for (i = 0; i < SEARCH_MODE_SAMPLES; i += SIMD_BATCH_KEYS) {
+			for (j = 0; j < SIMD_BATCH_KEYS; j++) {
+				get_random_bytes(&keys[j], sizeof(keys[j]));
+				keys[j] %= (TREE_SIZE + 1);
+			}
+			ktget(&stopwatch[0]);
+			found += cbtree_lookup_simd(&cbtree, &cbtree_geo32, keys,
+					vals, SIMD_BATCH_KEYS);
+			ktget(&stopwatch[1]);
+			elapsed = ktime_add_safe(elapsed,
+					ktime_sub(stopwatch[1], stopwatch[0]));
+		}
+		printk("cbtree %s search: %lld ns per lookup, %lu of %lu found\n",
+				names[m], ktime_to_ns(elapsed) / i, found, i);
+	}
+	cbtree_simd_enabled = saved;
+out:
+	kfree(keys);
+	kfree(vals);
+}
+
+/**
+ * @brief random lookups on the filled cbtree, one cbtree_lookup per key vs cbtree_lookup_batch over SIMD_BATCH_KEYS keys
+*/
+void profile_lookup_batch(void){
+	static const char * const names[] = { "single", "batch" };
+	unsigned long *keys;
+	void **vals;
+	unsigned long i, j, found;
+	ktime_t stopwatch[2], elapsed;
+	int m;
+
+	keys = kmalloc_array(SIMD_BATCH_KEYS, sizeof(*keys), GFP_KERNEL);
+	vals = kmalloc_array(SIMD_BATCH_KEYS, sizeof(*vals), GFP_KERNEL);
+	if (!keys || !vals)
+		goto out;
+
+	for (m = 0; m < ARRAY_SIZE(names); m++) {
+		elapsed = 0;
+		found = 0;
+		for (i = 0; i < SEARCH_MODE_SAMPLES; i += SIMD_BATCH_KEYS) {
+			for (j = 0; j < SIMD_BATCH_KEYS; j++) {
+				get_random_bytes(&keys[j], sizeof(keys[j]));
+				keys[j] %= (TREE_SIZE + 1);
+			}
+			ktget(&stopwatch[0]);
+			if (m) {
+				found += cbtree_lookup_batch(&cbtree, &cbtree_geo32,
+						keys, vals, SIMD_BATCH_KEYS);
+			} else {
+				for (j = 0; j < SIMD_BATCH_KEYS; j++)
+					if (cbtree_lookup(&cbtree, &cbtree_geo32, &keys[j]))
+						found++;
+			}
+			ktget(&stopwatch[1]);
+			elapsed = ktime_add_safe(elapsed,
+					ktime_sub(stopwatch[1], stopwatch[0]));
+		}
+		printk("cbtree %s lookup: %lld ns per lookup, %lu of %lu found\n",
+				names[m], ktime_to_ns(elapsed) / i, found, i);
+	}
+out:
+	kfree(keys);
+	kfree(vals);
+}
+
+/**
+ * @brief build a SWEEP_SIZE key cbtree with cbtree_insert and with cbtree_bulk_load, report build time and node fill
+*/
+void profile_bulk_load(void){
+	static const char * const names[] = { "insert", "bulk load" };
+	struct cbtree_head tree;
+	struct cbtree_stats stats;
+	unsigned long *keys;
+	void **vals;
+	ktime_t stopwatch[2];
+	unsigned long i;
+	int m, err = 0;
+
+	keys = kvmalloc_array(SWEEP_SIZE, sizeof(*keys), GFP_KERNEL);
+	vals = kvmalloc_array(SWEEP_SIZE, sizeof(*vals), GFP_KERNEL);
+	if (!keys || !vals)
+		goto out;
+	for (i = 0; i < SWEEP_SIZE; i++) {
+		keys[i] = i + 1;
+		vals[i] = (void *)(i + 1);
+	}
+
+	for (m = 0; m < ARRAY_SIZE(names); m++) {
+		if (cbtree_init(&tree))
+			break;
+
+		ktget(&stopwatch[0]);
+		if (m) {
+			err = cbtree_bulk_load(&tree, &cbtree_geo32, keys, vals,
+					SWEEP_SIZE, 100);
+		} else {
+			for (i = 0; i < SWEEP_SIZE && !err; i++)
+				err = cbtree_insert(&tree, &cbtree_geo32, &keys[i],
+						vals[i], GFP_KERNEL);
+		}
+		ktget(&stopwatch[1]);
+
+		cbtree_stats(&tree, &cbtree_geo32, &stats);
+		if (err)
+			printk("cbtree %s: failed (%d)\n", names[m], err);
+		else
+			printk("cbtree %s: %lld ms, height %d, %zu leaves, %zu%% full\n",
+					names[m],
+					ktime_to_ms(ktime_sub(stopwatch[1], stopwatch[0])),
+					stats.height, stats.leaves,
+					stats.entries * 100 /
+					(stats.leaves * cbtree_geo32.no_pairs));
+
+		cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+		cbtree_destroy(&tree);
+	}
+out:
+	kvfree(keys);
+	kvfree(vals);
+}
+
+/**
+ * @brief scan RANGE_LEN keys from a random key with cbtree_get_prev, cbtree_for_each_range_reverse and cbtree_get_next
+*/
+void profile_range_scan(void){
+	struct cbtree_iter iter;
+	unsigned long i, n, lo, hi, key, items[3] = { 0, 0, 0 };
+	ktime_t stopwatch[2], elapsed[3] = { 0, 0, 0 };
+	void *val;
+
+	for (i = 0; i < RANGE_SCANS; i++) {
+		get_random_bytes(&hi, sizeof(hi));
+		hi = hi % TREE_SIZE + 1;
+		lo = hi > RANGE_LEN ? hi - RANGE_LEN + 1 : 1;
+
+		ktget(&stopwatch[0]);
+		key = hi + 1;
+		for (n = 0; n < RANGE_LEN; n++) {
+			if (!cbtree_get_prev(&cbtree, &cbtree_geo32, &key) || key < lo)
+				break;
+		}
+		ktget(&stopwatch[1]);
+		items[0] += n;
+		elapsed[0] = ktime_add_safe(elapsed[0], ktime_sub(stopwatch[1], stopwatch[0]));
+
+		ktget(&stopwatch[0]);
+		n = 0;
+		cbtree_for_each_range_reverse(&cbtree, &cbtree_geo32, &iter, &lo, &hi, &key, val)
+			n++;
+		ktget(&stopwatch[1]);
+		items[1] += n;
+		elapsed[1] = ktime_add_safe(elapsed[1], ktime_sub(stopwatch[1], stopwatch[0]));
+
+		ktget(&stopwatch[0]);
+		key = lo - 1;
+		for (n = 0; n < RANGE_LEN; n++) {
+			if (!cbtree_get_next(&cbtree, &cbtree_geo32, &key) || key > hi)
+				break;
+		}
+		ktget(&stopwatch[1]);
+		items[2] += n;
+		elapsed[2] = ktime_add_safe(elapsed[2], ktime_sub(stopwatch[1], stopwatch[0]));
+	}
+	printk("cbtree range scan: get_prev %lld ns per item, iterator %lld ns per item, get_next %lld ns per item\n",
+			ktime_to_ns(elapsed[0]) / max(items[0], 1UL),
+			ktime_to_ns(elapsed[1]) / max(items[1], 1UL),
+			ktime_to_ns(elapsed[2]) / max(items[2], 1UL));
+}
+
+/**
+ * @brief insert SWEEP_SIZE increasing keys with even splits and with the append split policy, report nodes and memory per key
+*/
+void profile_append_split(void){
+	static const int fills[] = { 0, CBTREE_APPEND_FILL, 100 };
+	struct cbtree_head tree;
+	struct cbtree_stats stats;
+	ktime_t stopwatch[2];
+	unsigned long i, key;
+	int f;
+
+	for (f = 0; f < ARRAY_SIZE(fills); f++) {
+		if (cbtree_init(&tree))
+			return;
+		tree.append_fill = fills[f];
+
+		ktget(&stopwatch[0]);
+		for (i = 1; i <= SWEEP_SIZE; i++) {
+			key = i;
+			if (cbtree_insert(&tree, &cbtree_geo32, &key, (void *)i, GFP_KERNEL))
+				break;
+		}
+		ktget(&stopwatch[1]);
+
+		cbtree_stats(&tree, &cbtree_geo32, &stats);
+		if (!stats.entries)
+			stats.entries = 1;
+		printk("cbtree append_fill %d: %zu nodes, height %d, insert %lld ns, %zu.%02zu bytes per key\n",
+				fills[f], stats.nodes, stats.height,
+				ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0])) / SWEEP_SIZE,
+				stats.bytes / stats.entries,
+				stats.bytes * 100 / stats.entries % 100);
+
+		cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+		cbtree_destroy(&tree);
+	}
+}
+
+/**
+ * @brief drop the middle half of a SWEEP_SIZE key cbtree key by key and with cbtree_remove_range, report time and nodes left
+*/
+void profile_remove_range(void){
+	static const char * const names[] = { "remove loop", "remove_range" };
+	struct cbtree_head tree;
+	struct cbtree_stats stats;
+	unsigned long *keys;
+	void **vals;
+	ktime_t stopwatch[2];
+	unsigned long i, lo, hi;
+	size_t n;
+	int m;
+
+	keys = kvmalloc_array(SWEEP_SIZE, sizeof(*keys), GFP_KERNEL);
+	vals = kvmalloc_array(SWEEP_SIZE, sizeof(*vals), GFP_KERNEL);
+	if (!keys || !vals)
+		goto out;
+	for (i = 0; i < SWEEP_SIZE; i++) {
+		keys[i] = i + 1;
+		vals[i] = (void *)(i + 1);
+	}
+
+	for (m = 0; m < ARRAY_SIZE(names); m++) {
+		if (cbtree_init(&tree))
+			break;
+		if (cbtree_bulk_load(&tree, &cbtree_geo32, keys, vals, SWEEP_SIZE, 100)) {
+			cbtree_destroy(&tree);
+			break;
+		}
+		lo = SWEEP_SIZE / 4;
+		hi = lo + SWEEP_SIZE / 2 - 1;
+
+		ktget(&stopwatch[0]);
+		if (m) {
+			n = cbtree_remove_range(&tree, &cbtree_geo32, &lo, &hi, 0,
+					NULL, NULL);
+		} else {
+			for (n = 0, i = lo; i <= hi; i++)
+				n += !!cbtree_remove(&tree, &cbtree_geo32, &i);
+		}
+		ktget(&stopwatch[1]);
+
+		cbtree_stats(&tree, &cbtree_geo32, &stats);
+		printk("cbtree %s: %zu keys in %lld ms, %zu nodes, height %d left\n",
+				names[m], n,
+				ktime_to_ms(ktime_sub(stopwatch[1], stopwatch[0])),
+				stats.nodes, stats.height);
+
+		cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+		cbtree_destroy(&tree);
+	}
+out:
+	kvfree(keys);
+	kvfree(vals);
+}
+
+/**
+ * @brief run random removes and inserts 3:1 on a SWEEP_SIZE key cbtree with and without CBTREE_BORROW, report node fill
+*/
+void profile_borrow(void){
+	static const unsigned int flags[] = { 0, CBTREE_BORROW };
+	struct cbtree_head tree;
+	struct cbtree_stats stats;
+	ktime_t stopwatch[2];
+	unsigned long i, key;
+	int f;
+
+	for (f = 0; f < ARRAY_SIZE(flags); f++) {
+		if (cbtree_init(&tree))
+			return;
+		tree.flags = flags[f];
+
+		for (i = 1; i <= SWEEP_SIZE; i++) {
+			key = i;
+			if (cbtree_insert(&tree, &cbtree_geo32, &key, (void *)i, GFP_KERNEL))
+				break;
+		}
+
+		/* remove three keys for every one put back */
+		ktget(&stopwatch[0]);
+		for (i = 0; i < 4 * SWEEP_SIZE; i++) {
+			get_random_bytes(&key, sizeof(key));
+			key = key % SWEEP_SIZE + 1;
+			if (i % 4)
+				cbtree_remove(&tree, &cbtree_geo32, &key);
+			else if (!cbtree_lookup(&tree, &cbtree_geo32, &key))
+				cbtree_insert(&tree, &cbtree_geo32, &key, (void *)key, GFP_KERNEL);
+		}
+		ktget(&stopwatch[1]);
+
+		cbtree_stats(&tree, &cbtree_geo32, &stats);
+		if (!stats.slots)
+			stats.slots = 1;
+		printk("cbtree borrow %s: %lld ns per op, %zu entries, %zu nodes, height %d, leaves %zu%% full, min fill %d/%d\n",
+				flags[f] ? "on" : "off",
+				ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0])) / (4 * SWEEP_SIZE),
+				stats.entries, stats.nodes, stats.height,
+				stats.entries * 100 / stats.slots,
+				stats.min_fill, cbtree_geo32.no_pairs);
+
+		cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+		cbtree_destroy(&tree);
+	}
+}
+
+/**
+ * @brief merge staging trees into a SWEEP_SIZE key cbtree: interleaved keys, a small batch and a disjoint key range, report merge time
+*/
+void profile_merge(void){
+	static const char * const names[] = { "interleaved", "small", "disjoint" };
+	static const unsigned long sizes[] = { SWEEP_SIZE / 2, SWEEP_SIZE / 1000, SWEEP_SIZE };
+	struct cbtree_head tree, staging;
+	struct cbtree_stats stats;
+	ktime_t stopwatch[2];
+	unsigned long i, key;
+	int m, err;
+
+	for (m = 0; m < ARRAY_SIZE(names); m++) {
+		if (cbtree_init(&tree))
+			return;
+		if (cbtree_init(&staging)) {
+			cbtree_destroy(&tree);
+			return;
+		}
+
+		/* tree gets the even keys, staging odd keys or keys above them */
+		for (i = 1; i <= SWEEP_SIZE; i++) {
+			key = 2 * i;
+			if (cbtree_insert(&tree, &cbtree_geo32, &key, (void *)key, GFP_KERNEL))
+				break;
+		}
+		for (i = 1; i <= sizes[m]; i++) {
+			key = m == 2 ? 2 * SWEEP_SIZE + i : 2 * i * (SWEEP_SIZE / sizes[m]) - 1;
+			if (cbtree_insert(&staging, &cbtree_geo32, &key, (void *)key, GFP_KERNEL))
+				break;
+		}
+
+		ktget(&stopwatch[0]);
+		err = cbtree_merge(&tree, &staging, &cbtree_geo32, GFP_KERNEL);
+		ktget(&stopwatch[1]);
+
+		cbtree_stats(&tree, &cbtree_geo32, &stats);
+		if (err)
+			printk("cbtree merge %s: failed (%d)\n", names[m], err);
+		else
+			printk("cbtree merge %s: %lu keys in %lld us, %zu entries, height %d\n",
+					names[m], sizes[m],
+					ktime_to_us(ktime_sub(stopwatch[1], stopwatch[0])),
+					stats.entries, stats.height);
+
+		cbtree_grim_visitor(&staging, &cbtree_geo32, 0, NULL, NULL);
+		cbtree_destroy(&staging);
+		cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+		cbtree_destroy(&tree);
+	}
+}
+
+/**
+ * @brief split a SWEEP_SIZE key cbtree at random keys and merge the halves back, report the time of both
+*/
+void profile_split(void){
+	struct cbtree_head tree, upper;
+	ktime_t stopwatch[3], elapsed[2] = { 0, 0 };
+	unsigned long i, key;
+	int err = 0;
+
+	if (cbtree_init(&tree))
+		return;
+	if (cbtree_init(&upper)) {
+		cbtree_destroy(&tree);
+		return;
+	}
+	for (i = 1; i <= SWEEP_SIZE; i++) {
+		key = i;
+		if (cbtree_insert(&tree, &cbtree_geo32, &key, (void *)i, GFP_KERNEL))
+			break;
+	}
+
+	for (i = 0; i < RANGE_SCANS && !err; i++) {
+		get_random_bytes(&key, sizeof(key));
+		key = key % SWEEP_SIZE + 1;
+
+		ktget(&stopwatch[0]);
+		err = cbtree_split(&tree, &cbtree_geo32, &key, &upper, GFP_KERNEL);
+		ktget(&stopwatch[1]);
+		if (!err)
+			err = cbtree_merge(&tree, &upper, &cbtree_geo32, GFP_KERNEL);
+		ktget(&stopwatch[2]);
+		elapsed[0] = ktime_add_safe(elapsed[0], ktime_sub(stopwatch[1], stopwatch[0]));
+		elapsed[1] = ktime_add_safe(elapsed[1], ktime_sub(stopwatch[2], stopwatch[1]));
+	}
+	if (err)
+		printk("cbtree split: failed (%d)\n", err);
+	else
+		printk("cbtree split: %lld ns per split, %lld ns per merge back\n",
+				ktime_to_ns(elapsed[0]) / RANGE_SCANS,
+				ktime_to_ns(elapsed[1]) / RANGE_SCANS);
+
+	cbtree_grim_visitor(&upper, &cbtree_geo32, 0, NULL, NULL);
+	cbtree_destroy(&upper);
+	cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+	cbtree_destroy(&tree);
+}
+
+/**
+ * @brief look up a skewed key mix (70% from 1000 hot keys, the rest one-offs) in a SWEEP_SIZE key cbtree under each cache policy
+*/
+void profile_cache_policy(void){
+	static const char * const names[] = { "round robin", "clock", "lfu" };
+	static const unsigned char policies[] = {
+		CBTREE_CACHE_RR, CBTREE_CACHE_CLOCK, CBTREE_CACHE_LFU,
+	};
+	struct cbtree_head tree;
+	ktime_t stopwatch[2];
+	unsigned long i, key, rnd;
+	int p;
+
+	for (p = 0; p < ARRAY_SIZE(policies); p++) {
+		if (cbtree_init(&tree))
+			return;
+		tree.cache_policy = policies[p];
+		for (i = 1; i <= SWEEP_SIZE; i++) {
+			key = i;
+			if (cbtree_insert(&tree, &cbtree_geo32, &key, (void *)i, GFP_KERNEL))
+				break;
+		}
+
+		ktget(&stopwatch[0]);
+		for (i = 0; i < SEARCH_MODE_SAMPLES; i++) {
+			get_random_bytes(&rnd, sizeof(rnd));
+			if (rnd % 10 < 7)
+				key = (rnd / 10 % 1000) * (SWEEP_SIZE / 1000) + 1;
+			else
+				key = rnd / 10 % SWEEP_SIZE + 1;
+			cbtree_lookup(&tree, &cbtree_geo32, &key);
+		}
+		ktget(&stopwatch[1]);
+		printk("cbtree cache %s: %lld ns per skewed lookup\n", names[p],
+				ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0])) / SEARCH_MODE_SAMPLES);
+
+		cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+		cbtree_destroy(&tree);
+	}
+}
+
+/**
+ * @brief look up the skewed key mix of profile_cache_policy() with hot-key tables of several byte budgets
+*/
+void profile_hot_keys(void){
+	static const size_t budgets[] = { 0, 16 << 10, 64 << 10, 256 << 10 };
+	struct cbtree_head tree;
+	ktime_t stopwatch[2];
+	unsigned long i, key, rnd;
+	int b, err;
+
+	for (b = 0; b < ARRAY_SIZE(budgets); b++) {
+		if (cbtree_init(&tree))
+			return;
+		err = cbtree_init_hot(&tree, budgets[b]);
+		if (err) {
+			printk("cbtree hot keys %zu KiB: init failed (%d)\n", budgets[b] >> 10, err);
+			cbtree_destroy(&tree);
+			continue;
+		}
+		for (i = 1; i <= SWEEP_SIZE; i++) {
+			key = i;
+			if (cbtree_insert(&tree, &cbtree_geo32, &key, (void *)i, GFP_KERNEL))
+				break;
+		}
+
+		ktget(&stopwatch[0]);
+		for (i = 0; i < SEARCH_MODE_SAMPLES; i++) {
+			get_random_bytes(&rnd, sizeof(rnd));
+			if (rnd % 10 < 7)
+				key = (rnd / 10 % 1000) * (SWEEP_SIZE / 1000) + 1;
+			else
+				key = rnd / 10 % SWEEP_SIZE + 1;
+			cbtree_lookup(&tree, &cbtree_geo32, &key);
+		}
+		ktget(&stopwatch[1]);
+		printk("cbtree hot keys %zu KiB: %lld ns per skewed lookup\n", budgets[b] >> 10,
+				ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0])) / SEARCH_MODE_SAMPLES);
+
+		cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+		cbtree_destroy(&tree);
+	}
+}
+
+struct rcu_reader {
+	struct cbtree_head *tree;
+	struct completion done;
+	u64 seed;
+};
+
+static int rcu_reader_fn(void *data){
+	struct rcu_reader *r = data;
+	unsigned long i, key;
+
+	for (i = 0; i < SEARCH_MODE_SAMPLES; i++) {
+		r->seed = r->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		key = (r->seed >> 33) % SWEEP_SIZE + 1;
+		cbtree_lookup(r->tree, &cbtree_geo32, &key);
+	}
+	complete(&r->done);
+	return 0;
+}
+
+/**
+ * @brief look up random keys of a CBTREE_RCU tree from 1, 2, 4, ... reader threads, alone and next to a writer
+*/
+void profile_rcu_lookups(void){
+	static struct rcu_reader readers[RCU_READERS_MAX];
+	struct cbtree_head tree;
+	ktime_t stopwatch[2];
+	unsigned long i, key, writes;
+	int n, t, max, writer;
+
+	if (cbtree_init(&tree))
+		return;
+	tree.flags |= CBTREE_RCU;
+	for (i = 1; i <= SWEEP_SIZE; i++) {
+		key = i;
+		if (cbtree_insert(&tree, &cbtree_geo32, &key, (void *)i, GFP_KERNEL))
+			break;
+	}
+
+	max = min(num_online_cpus(), RCU_READERS_MAX);
+	for (writer = 0; writer < 2; writer++) {
+		for (n = 1; ; n = min(n * 2, max)) {
+			writes = 0;
+			ktget(&stopwatch[0]);
+			for (t = 0; t < n; t++) {
+				readers[t].tree = &tree;
+				readers[t].seed = t + 1;
+				init_completion(&readers[t].done);
+				if (IS_ERR(kthread_run(rcu_reader_fn, &readers[t], "cbtree_rcu/%d", t)))
+					complete(&readers[t].done);
+			}
+			// keys above the tree's range come and go without touching the readers' keys
+			while (writer && !completion_done(&readers[0].done)) {
+				key = SWEEP_SIZE + 1 + writes % 1000;
+				if (writes++ / 1000 % 2 == 0)
+					cbtree_insert(&tree, &cbtree_geo32, &key, (void *)key, GFP_KERNEL);
+				else
+					cbtree_remove(&tree, &cbtree_geo32, &key);
+				cond_resched();
+			}
+			for (t = 0; t < n; t++)
+				wait_for_completion(&readers[t].done);
+			ktget(&stopwatch[1]);
+			printk("cbtree rcu lookups, %d readers%s: %lld lookups per ms, %lu writes\n",
+					n, writer ? " and a writer" : "",
+					(long long)n * SEARCH_MODE_SAMPLES * NSEC_PER_MSEC /
+					max_t(s64, 1, ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0]))),
+					writes);
+			if (n == max)
+				break;
+		}
+	}
+
+	cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+	cbtree_destroy(&tree);
+}
+
+struct rcu_writer {
+	struct cbtree_head *tree;
+	struct completion done;
+	unsigned long first, nr;
+};
+
+static int rcu_writer_fn(void *data){
+	struct rcu_writer *w = data;
+	unsigned long i, key;
+
+	for (i = 0; i < w->nr; i++) {
+		key = w->first + i;
+		if (cbtree_insert(w->tree, &cbtree_geo32, &key, (void *)key, GFP_KERNEL))
+			break;
+	}
+	complete(&w->done);
+	return 0;
+}
+
+/**
+ * @brief fill a CBTREE_RCU tree from 1, 2, 4, ... writer threads, each appending its own range of keys
+*/
+void profile_rcu_inserts(void){
+	static struct rcu_writer writers[RCU_READERS_MAX];
+	struct cbtree_head tree;
+	ktime_t stopwatch[2];
+	unsigned long key;
+	int n, t, max;
+
+	max = min(num_online_cpus(), RCU_READERS_MAX);
+	for (n = 1; ; n = min(n * 2, max)) {
+		if (cbtree_init(&tree))
+			return;
+		tree.flags |= CBTREE_RCU;
+		// a first key per range, so that the writers start out in different leaves
+		for (t = 0; t < n; t++) {
+			key = (unsigned long)t * (SWEEP_SIZE / n) + 1;
+			cbtree_insert(&tree, &cbtree_geo32, &key, (void *)key, GFP_KERNEL);
+		}
+		ktget(&stopwatch[0]);
+		for (t = 0; t < n; t++) {
+			writers[t].tree = &tree;
+			writers[t].first = (unsigned long)t * (SWEEP_SIZE / n) + 2;
+			writers[t].nr = SWEEP_SIZE / n - 1;
+			init_completion(&writers[t].done);
+			if (IS_ERR(kthread_run(rcu_writer_fn, &writers[t], "cbtree_olc/%d", t)))
+				complete(&writers[t].done);
+		}
+		for (t = 0; t < n; t++)
+			wait_for_completion(&writers[t].done);
+		ktget(&stopwatch[1]);
+		printk("cbtree rcu inserts, %d writers: %lld inserts per ms, height %d\n",
+				n, (long long)n * (SWEEP_SIZE / n - 1) * NSEC_PER_MSEC /
+				max_t(s64, 1, ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0]))),
+				tree.height);
+		cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+		cbtree_destroy(&tree);
+		if (n == max)
+			break;
+	}
+}
+
+/**
+ * @brief random lookups from all CPUs at once on a SWEEP_SIZE key cbtree, filling the node caches on every miss and at the default rate
+*/
+void profile_cache_fill(void){
+	static struct rcu_reader readers[RCU_READERS_MAX];
+	static const int fills[] = { 1, CBTREE_CACHE_FILL };
+	int saved = cbtree_cache_fill;
+	struct cbtree_head tree;
+	ktime_t stopwatch[2];
+	unsigned long i, key;
+	int f, t, n;
+
+	if (cbtree_init(&tree))
+		return;
+	for (i = 1; i <= SWEEP_SIZE; i++) {
+		key = i;
+		if (cbtree_insert(&tree, &cbtree_geo32, &key, (void *)i, GFP_KERNEL))
+			break;
+	}
+
+	n = min(num_online_cpus(), RCU_READERS_MAX);
+	for (f = 0; f < ARRAY_SIZE(fills); f++) {
+		cbtree_cache_fill = fills[f];
+		ktget(&stopwatch[0]);
+		for (t = 0; t < n; t++) {
+			readers[t].tree = &tree;
+			readers[t].seed = t + 1;
+			init_completion(&readers[t].done);
+			if (IS_ERR(kthread_run(rcu_reader_fn, &readers[t], "cbtree_fill/%d", t)))
+				complete(&readers[t].done);
+		}
+		for (t = 0; t < n; t++)
+			wait_for_completion(&readers[t].done);
+		ktget(&stopwatch[1]);
+		printk("cbtree cache fill 1/%d, %d readers: %lld lookups per ms\n",
+				fills[f], n, (long long)n * SEARCH_MODE_SAMPLES * NSEC_PER_MSEC /
+				max_t(s64, 1, ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0]))));
+	}
+	cbtree_cache_fill = saved;
+
+	cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+	cbtree_destroy(&tree);
+}
+
+struct shard_writer {
+	struct cbtree_sharded_head *sh;
+	struct completion done;
+	u64 seed;
+	unsigned long nr;
+};
+
+static int shard_writer_fn(void *data){
+	struct shard_writer *w = data;
+	unsigned long i, key;
+
+	for (i = 0; i < w->nr; i++) {
+		w->seed = w->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		key = w->seed | 1;
+		if (cbtree_shard_insert(w->sh, &key, (void *)key, GFP_KERNEL))
+			break;
+	}
+	complete(&w->done);
+	return 0;
+}
+
+static void count_entry(void *elem, unsigned long opaque, unsigned long *key,
+		size_t index, void *func2){
+}
+
+/**
+ * @brief random inserts from one writer per CPU into 1 and into num_online_cpus() range shards, then a skewed fill evened out by rebalancing
+*/
+void profile_sharded(void){
+	static struct shard_writer writers[RCU_READERS_MAX];
+	struct cbtree_sharded_head sh;
+	ktime_t stopwatch[2];
+	unsigned long i, key, lo = 0, hi = ULONG_MAX;
+	unsigned int k, min, max;
+	int n, t, rounds;
+
+	n = min(num_online_cpus(), RCU_READERS_MAX);
+	for (k = 1; ; k = n) {
+		if (cbtree_shard_init(&sh, &cbtree_geo32, k, NULL))
+			return;
+		ktget(&stopwatch[0]);
+		for (t = 0; t < n; t++) {
+			writers[t].sh = &sh;
+			writers[t].seed = t + 1;
+			writers[t].nr = SWEEP_SIZE / n;
+			init_completion(&writers[t].done);
+			if (IS_ERR(kthread_run(shard_writer_fn, &writers[t], "cbtree_shard/%d", t)))
+				complete(&writers[t].done);
+		}
+		for (t = 0; t < n; t++)
+			wait_for_completion(&writers[t].done);
+		ktget(&stopwatch[1]);
+		printk("cbtree sharded inserts, %u shards, %d writers: %lld inserts per ms, %zu in range scan\n",
+				k, n, (long long)n * (SWEEP_SIZE / n) * NSEC_PER_MSEC /
+				max_t(s64, 1, ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0]))),
+				cbtree_shard_range(&sh, &lo, &hi, 0, count_entry, NULL));
+		cbtree_shard_destroy(&sh);
+		if (k == n)
+			break;
+	}
+
+	// every key in the first shard, then move bounds until the shards are even
+	if (cbtree_shard_init(&sh, &cbtree_geo32, n, NULL))
+		return;
+	for (i = 1; i <= SWEEP_SIZE; i++) {
+		key = i;
+		if (cbtree_shard_insert(&sh, &key, (void *)i, GFP_KERNEL))
+			break;
+	}
+	ktget(&stopwatch[0]);
+	for (rounds = 0; rounds < 4 * n && cbtree_shard_rebalance(&sh) > 0; rounds++)
+		;
+	ktget(&stopwatch[1]);
+	min = max = sh.shards[0].entries;
+	for (t = 1; t < n; t++) {
+		min = min_t(unsigned int, min, sh.shards[t].entries);
+		max = max_t(unsigned int, max, sh.shards[t].entries);
+	}
+	printk("cbtree shard rebalance: %d rounds in %lld us, %u to %u entries per shard, %zu in range scan\n",
+			rounds, ktime_to_us(ktime_sub(stopwatch[1], stopwatch[0])), min, max,
+			cbtree_shard_range(&sh, &lo, &hi, 0, count_entry, NULL));
+	cbtree_shard_destroy(&sh);
+}
+
+/**
+ * @brief build a cbtree per supported node size and report insert/lookup latency and memory per key
+*/
+void profile_nodesize_sweep(void){
+	static const unsigned int sizes[] = { 128, 256, 512, 1024, PAGE_SIZE };
+	struct cbtree_head tree;
+	struct cbtree_stats stats;
+	ktime_t stopwatch[2], insert_time, lookup_time;
+	unsigned long i, key;
+	int s, err;
+
+	for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+		err = cbtree_init_nodesize(&tree, &cbtree_geo32, sizes[s]);
+		if (err) {
+			printk("cbtree nodesize %u: init failed (%d)\n", sizes[s], err);
+			continue;
+		}
+
+		ktget(&stopwatch[0]);
+		for (i = 1; i <= SWEEP_SIZE; i++) {
+			key = i;
+			if (cbtree_insert(&tree, &cbtree_geo32, &key, (void *)i, GFP_KERNEL))
+				break;
+		}
+		ktget(&stopwatch[1]);
+		insert_time = ktime_sub(stopwatch[1], stopwatch[0]);
+
+		ktget(&stopwatch[0]);
+		for (i = 0; i < SWEEP_SIZE; i++) {
+			get_random_bytes(&key, sizeof(key));
+			key = key % SWEEP_SIZE + 1;
+			cbtree_lookup(&tree, &cbtree_geo32, &key);
+		}
+		ktget(&stopwatch[1]);
+		lookup_time = ktime_sub(stopwatch[1], stopwatch[0]);
+
+		cbtree_stats(&tree, &cbtree_geo32, &stats);
+		if (!stats.entries)
+			stats.entries = 1;
+		printk("cbtree nodesize %u: %d pairs, height %d, insert %lld ns, lookup %lld ns, %zu.%02zu bytes per key\n",
+				sizes[s], tree.geo.no_pairs, stats.height,
+				ktime_to_ns(insert_time) / SWEEP_SIZE,
+				ktime_to_ns(lookup_time) / SWEEP_SIZE,
+				stats.bytes / stats.entries,
+				stats.bytes * 100 / stats.entries % 100);
+
+		cbtree_grim_visitor(&tree, &cbtree_geo32, 0, NULL, NULL);
+		cbtree_destroy(&tree);
+	}
+}
+
+/**
+ * @brief random lookups on the filled cbtree (TREE_SIZE keys, far beyond the LLC) with and without CBTREE_PREFETCH
+*/
+void profile_prefetch(void){
+	static const unsigned int flags[] = { 0, CBTREE_PREFETCH };
+	unsigned int saved = cbtree.flags;
+	unsigned long i, key;
+	ktime_t stopwatch[2];
+	int f;
+
+	for (f = 0; f < ARRAY_SIZE(flags); f++) {
+		cbtree.flags = (saved & ~CBTREE_PREFETCH) | flags[f];
+		ktget(&stopwatch[0]);
+		for (i = 0; i < SEARCH_MODE_SAMPLES; i++) {
+			get_random_bytes(&key, sizeof(key));
+			key %= (TREE_SIZE + 1);
+			cbtree_lookup(&cbtree, &cbtree_geo32, &key);
+		}
+		ktget(&stopwatch[1]);
+		printk("cbtree prefetch %s: %lld ns per lookup\n",
+				flags[f] ? "on" : "off",
+				ktime_to_ns(ktime_sub(stopwatch[1], stopwatch[0])) / SEARCH_MODE_SAMPLES);
+	}
+	cbtree.flags = saved;
+}
+
+/**
+ * @brief compare u32 keys stored one per long (cbtree_geo32) with packed u32 keys (cbtree_geo32p)
+*/
+void profile_packed32(void){
+	static struct cbtree_geo *geos[] = { &cbtree_geo32, &cbtree_geo32p };
+	static const char *names[] = { "geo32", "geo32p" };
+	struct cbtree_head tree;
+	struct cbtree_stats stats;
+	ktime_t stopwatch[2], lookup_time;
+	unsigned long i, key;
+	int g;
+
+	for (g = 0; g < ARRAY_SIZE(geos); g++) {
+		if (cbtree_init(&tree))
+			return;
+
+		for (i = 1; i <= SWEEP_SIZE; i++) {
+			key = i;
+			if (cbtree_insert(&tree, geos[g], &key, (void *)i, GFP_KERNEL))
+				break;
+		}
+
+		ktget(&stopwatch[0]);
+		for (i = 0; i < SWEEP_SIZE; i++) {
+			get_random_bytes(&key, sizeof(key));
+			key = key % SWEEP_SIZE + 1;
+			cbtree_lookup(&tree, geos[g], &key);
+		}
+		ktget(&stopwatch[1]);
+		lookup_time = ktime_sub(stopwatch[1], stopwatch[0]);
+
+		cbtree_stats(&tree, geos[g], &stats);
+		if (!stats.entries)
+			stats.entries = 1;
+		printk("cbtree %s: %d pairs, height %d, %zu nodes, lookup %lld ns, %zu.%02zu bytes per key\n",
+				names[g], geos[g]->no_pairs, stats.height, stats.nodes,
+				ktime_to_ns(lookup_time) / SWEEP_SIZE,
+				stats.bytes / stats.entries,
+				stats.bytes * 100 / stats.entries % 100);
+
+		cbtree_grim_visitor(&tree, geos[g], 0, NULL, NULL);
+		cbtree_destroy(&tree);
+	}
+}
+
+/**
+ * @brief print the per-level node cache counters and the cache memory of the main cbtree
+*/
+void print_cache_stats(void){
+	struct cbtree_cache_stats cs;
+	struct cbtree_stats stats;
+	int level;
+
+	for (level = 2; level < CBTREE_CACHE_LEVELS + 2; level++) {
+		cbtree_cache_stats(level, &cs);
+		if (!cs.probes)
+			continue;
+		printk("cbtree cache level %d%s: %lu probes, %lu hits (%lu%%), %lu misses, %lu evictions, %lu stale\n",
+				level, level == CBTREE_CACHE_LEVELS + 1 ? "+" : "",
+				cs.probes, cs.hits, cs.hits * 100 / cs.probes,
+				cs.misses, cs.evictions, cs.stale);
+	}
+	cbtree_stats(&cbtree, &cbtree_geo32, &stats);
+	printk("cbtree cache memory: %zu of %zu bytes\n", stats.cache_bytes, stats.bytes);
+}
+
 static int __init bplus_module_init(void){
 
 	printk("Initializing bplus_module\n");
 
 	btree_cachep = kmem_cache_create("btree_node", NODESIZE, 0,
 			SLAB_HWCACHE_ALIGN, NULL);
-	cbtree_cachep = kmem_cache_create("cbtree_node", NODESIZE, 0,
+	cbtree_cachep = kmem_cache_create("cbtree_node", CBTREE_NODE_BYTES(NODESIZE), 0,
 			SLAB_HWCACHE_ALIGN, NULL);
 
 	if(!cbtree_cachep || !btree_cachep)
 		printk("fail");
+	cbtree_cache_debugfs_init();
 	
 	create_tree();
+	if (sweep) {
+		profile_nodesize_sweep();
+		return 0;
+	}
 	fill_tree();
 	find_tree();
+	profile_search_modes();
+	profile_prefetch();
+	profile_simd_search();
+	profile_lookup_batch();
+	profile_range_scan();
+	profile_packed32();
+	profile_bulk_load();
+	profile_append_split();
+	profile_remove_range();
+	profile_borrow();
+	profile_merge();
+	profile_split();
+	profile_cache_policy();
+	profile_hot_keys();
+	profile_rcu_lookups();
+	profile_rcu_inserts();
+	profile_cache_fill();
+	profile_sharded();
 	
 	return 0;
 }
 
 static void __exit bplus_module_exit(void){
+	// print_cache_stats() walks the tree, so report before the slab caches go away
+	print_cache_stats();
+	cbtree_cache_debugfs_exit();
+
 	kmem_cache_destroy(btree_cachep);
 	kmem_cache_destroy(cbtree_cachep);
 
@@ -14,6 +14,18 @@ static inline int cbtree_init128(struct cbtree_head128 *head)
 	return cbtree_init(&head->h);
 }
 
+static inline int cbtree_init_nodesize128(struct cbtree_head128 *head,
+					  unsigned int nodesize)
+{
+	return cbtree_init_nodesize(&head->h, &cbtree_geo128, nodesize);
+}
+
+static inline int cbtree_init_hot128(struct cbtree_head128 *head,
+				     size_t budget)
+{
+	return cbtree_init_hot(&head->h, budget);
+}
+
 static inline void cbtree_destroy128(struct cbtree_head128 *head)
 {
 	cbtree_destroy(&head->h);
@@ -22,7 +34,23 @@ static inline void cbtree_destroy128(struct cbtree_head128 *head)
 static inline void *cbtree_lookup128(struct cbtree_head128 *head, u64 k1, u64 k2)
 {
 	u64 key[2] = {k1, k2};
-	return cbtree_lookup(&head->h, &cbtree_geo128, (unsigned long *)&key);
+	return cbtree_lookup_geo128(&head->h, (unsigned long *)&key);
+}
+
+/* @keys holds @n pairs of k1, k2 */
+static inline size_t cbtree_lookup_batch128(struct cbtree_head128 *head,
+		const u64 *keys, void **vals, size_t n)
+{
+	return cbtree_lookup_batch(&head->h, &cbtree_geo128,
+			(unsigned long *)keys, vals, n);
+}
+
+/* @keys holds @n pairs of k1, k2, ascending */
+static inline int cbtree_bulk_load128(struct cbtree_head128 *head,
+		const u64 *keys, void **vals, size_t n, int fill_factor)
+{
+	return cbtree_bulk_load(&head->h, &cbtree_geo128,
+			(unsigned long *)keys, vals, n, fill_factor);
 }
 
 static inline void *cbtree_get_prev128(struct cbtree_head128 *head,
@@ -42,8 +70,7 @@ static inline int cbtree_insert128(struct cbtree_head128 *head, u64 k1, u64 k2,
 				  void *val, gfp_t gfp)
 {
 	u64 key[2] = {k1, k2};
-	return cbtree_insert(&head->h, &cbtree_geo128,
-			    (unsigned long *)&key, val, gfp);
+	return cbtree_insert_geo128(&head->h, (unsigned long *)&key, val, gfp);
 }
 
 static inline int cbtree_update128(struct cbtree_head128 *head, u64 k1, u64 k2,
@@ -57,7 +84,7 @@ static inline int cbtree_update128(struct cbtree_head128 *head, u64 k1, u64 k2,
 static inline void *cbtree_remove128(struct cbtree_head128 *head, u64 k1, u64 k2)
 {
 	u64 key[2] = {k1, k2};
-	return cbtree_remove(&head->h, &cbtree_geo128, (unsigned long *)&key);
+	return cbtree_remove_geo128(&head->h, (unsigned long *)&key);
 }
 
 static inline void *cbtree_last128(struct cbtree_head128 *head, u64 *k1, u64 *k2)
@@ -81,6 +108,14 @@ static inline int cbtree_merge128(struct cbtree_head128 *target,
 	return cbtree_merge(&target->h, &victim->h, &cbtree_geo128, gfp);
 }
 
+static inline int cbtree_split128(struct cbtree_head128 *head, u64 k1, u64 k2,
+				 struct cbtree_head128 *out, gfp_t gfp)
+{
+	u64 key[2] = {k1, k2};
+	return cbtree_split(&head->h, &cbtree_geo128, (unsigned long *)&key,
+			&out->h, gfp);
+}
+
 void cvisitor128(void *elem, unsigned long opaque, unsigned long *__key,
 		size_t index, void *__func);
 
@@ -95,6 +130,17 @@ static inline size_t cbtree_cvisitor128(struct cbtree_head128 *head,
 			     cvisitor128, func2);
 }
 
+static inline size_t cbtree_remove_range128(struct cbtree_head128 *head,
+		u64 lo1, u64 lo2, u64 hi1, u64 hi2, unsigned long opaque,
+		visitor128_t func2)
+{
+	u64 lo[2] = {lo1, lo2}, hi[2] = {hi1, hi2};
+
+	return cbtree_remove_range(&head->h, &cbtree_geo128,
+			(unsigned long *)lo, (unsigned long *)hi, opaque,
+			func2 ? cvisitor128 : NULL, func2);
+}
+
 static inline size_t cbtree_grim_cvisitor128(struct cbtree_head128 *head,
 					   unsigned long opaque,
 					   visitor128_t func2)
@@ -108,3 +154,109 @@ static inline size_t cbtree_grim_cvisitor128(struct cbtree_head128 *head,
 	     val;					\
 	     val = cbtree_get_prev128(head, &k1, &k2))
 
+static inline void *cbtree_first128(struct cbtree_head128 *head, u64 *k1, u64 *k2)
+{
+	u64 key[2];
+	void *val;
+
+	val = cbtree_first(&head->h, &cbtree_geo128, (unsigned long *)&key[0]);
+	if (val) {
+		*k1 = key[0];
+		*k2 = key[1];
+	}
+
+	return val;
+}
+
+static inline void *cbtree_get_next128(struct cbtree_head128 *head,
+				      u64 *k1, u64 *k2)
+{
+	u64 key[2] = {*k1, *k2};
+	void *val;
+
+	val = cbtree_get_next(&head->h, &cbtree_geo128,
+			     (unsigned long *)&key);
+	*k1 = key[0];
+	*k2 = key[1];
+	return val;
+}
+
+#define cbtree_for_each_next128(head, k1, k2, val)	\
+	for (val = cbtree_first128(head, &k1, &k2);	\
+	     val;					\
+	     val = cbtree_get_next128(head, &k1, &k2))
+
+static inline void *cbtree_iter_first128(struct cbtree_head128 *head,
+		struct cbtree_iter *iter, u64 lo1, u64 lo2, u64 hi1, u64 hi2,
+		u64 *k1, u64 *k2)
+{
+	u64 lo[2] = {lo1, lo2}, hi[2] = {hi1, hi2}, key[2];
+	void *val;
+
+	val = cbtree_iter_first(&head->h, &cbtree_geo128, iter,
+			(unsigned long *)lo, (unsigned long *)hi,
+			(unsigned long *)key);
+	if (val) {
+		*k1 = key[0];
+		*k2 = key[1];
+	}
+	return val;
+}
+
+static inline void *cbtree_iter_next128(struct cbtree_iter *iter,
+		u64 *k1, u64 *k2)
+{
+	u64 key[2];
+	void *val;
+
+	val = cbtree_iter_next(iter, (unsigned long *)key);
+	if (val) {
+		*k1 = key[0];
+		*k2 = key[1];
+	}
+	return val;
+}
+
+static inline void *cbtree_iter_last128(struct cbtree_head128 *head,
+		struct cbtree_iter *iter, u64 lo1, u64 lo2, u64 hi1, u64 hi2,
+		u64 *k1, u64 *k2)
+{
+	u64 lo[2] = {lo1, lo2}, hi[2] = {hi1, hi2}, key[2];
+	void *val;
+
+	val = cbtree_iter_last(&head->h, &cbtree_geo128, iter,
+			(unsigned long *)lo, (unsigned long *)hi,
+			(unsigned long *)key);
+	if (val) {
+		*k1 = key[0];
+		*k2 = key[1];
+	}
+	return val;
+}
+
+static inline void *cbtree_iter_prev128(struct cbtree_iter *iter,
+		u64 *k1, u64 *k2)
+{
+	u64 key[2];
+	void *val;
+
+	val = cbtree_iter_prev(iter, (unsigned long *)key);
+	if (val) {
+		*k1 = key[0];
+		*k2 = key[1];
+	}
+	return val;
+}
+
+#define cbtree_for_each_range128(head, iter, lo1, lo2, hi1, hi2, k1, k2, val) \
+	for (val = cbtree_iter_first128(head, iter, lo1, lo2, hi1, hi2,	\
+					&k1, &k2);			\
+	     val;							\
+	     val = cbtree_iter_next128(iter, &k1, &k2))
+
+#define cbtree_for_each_range_reverse128(head, iter, lo1, lo2, hi1, hi2, k1, k2, val) \
+	for (val = cbtree_iter_last128(head, iter, lo1, lo2, hi1, hi2,	\
+				       &k1, &k2);			\
+	     val;							\
+	     val = cbtree_iter_prev128(iter, &k1, &k2))
+
@@ -3,6 +3,7 @@
 #define _CBTREE_TP(pfx, type, sfx)	__CBTREE_TP(pfx, type, sfx)
 #define CBTREE_TP(pfx)			_CBTREE_TP(pfx, CBTREE_TYPE_SUFFIX,)
 #define CBTREE_FN(name)			CBTREE_TP(cbtree_ ## name)
+#define CBTREE_SPEC_FN(name)		_CBTREE_TP(cbtree_ ## name ## _, CBTREE_TYPE_SPEC,)
 #define CBTREE_TYPE_HEAD			CBTREE_TP(struct cbtree_head)
 #define VISITOR_FN			CBTREE_TP(visitor)
 #define VISITOR_FN_T			_CBTREE_TP(visitor, CBTREE_TYPE_SUFFIX, _t)
@@ -22,6 +23,17 @@ static inline int CBTREE_FN(init)(CBTREE_TYPE_HEAD *head)
 	return cbtree_init(&head->h);
 }
 
+static inline int CBTREE_FN(init_nodesize)(CBTREE_TYPE_HEAD *head,
+					  unsigned int nodesize)
+{
+	return cbtree_init_nodesize(&head->h, CBTREE_TYPE_GEO, nodesize);
+}
+
+static inline int CBTREE_FN(init_hot)(CBTREE_TYPE_HEAD *head, size_t budget)
+{
+	return cbtree_init_hot(&head->h, budget);
+}
+
 static inline void CBTREE_FN(destroy)(CBTREE_TYPE_HEAD *head)
 {
 	cbtree_destroy(&head->h);
@@ -35,17 +47,24 @@ static inline int CBTREE_FN(merge)(CBTREE_TYPE_HEAD *target,
 }
 
 #if (BITS_PER_LONG > CBTREE_TYPE_BITS)
+static inline int CBTREE_FN(split)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key,
+				  CBTREE_TYPE_HEAD *out, gfp_t gfp)
+{
+	unsigned long _key = key;
+	return cbtree_split(&head->h, CBTREE_TYPE_GEO, &_key, &out->h, gfp);
+}
+
 static inline void *CBTREE_FN(lookup)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key)
 {
 	unsigned long _key = key;
-	return cbtree_lookup(&head->h, CBTREE_TYPE_GEO, &_key);
+	return CBTREE_SPEC_FN(lookup)(&head->h, &_key);
 }
 
 static inline int CBTREE_FN(insert)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key,
 				   void *val, gfp_t gfp)
 {
 	unsigned long _key = key;
-	return cbtree_insert(&head->h, CBTREE_TYPE_GEO, &_key, val, gfp);
+	return CBTREE_SPEC_FN(insert)(&head->h, &_key, val, gfp);
 }
 
 static inline int CBTREE_FN(update)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key,
@@ -58,7 +77,7 @@ static inline int CBTREE_FN(update)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key,
 static inline void *CBTREE_FN(remove)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key)
 {
 	unsigned long _key = key;
-	return cbtree_remove(&head->h, CBTREE_TYPE_GEO, &_key);
+	return CBTREE_SPEC_FN(remove)(&head->h, &_key);
 }
 
 static inline void *CBTREE_FN(last)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE *key)
@@ -78,17 +97,121 @@ static inline void *CBTREE_FN(get_prev)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE *
 		*key = _key;
 	return val;
 }
+
+static inline void *CBTREE_FN(first)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE *key)
+{
+	unsigned long _key;
+	void *val = cbtree_first(&head->h, CBTREE_TYPE_GEO, &_key);
+	if (val)
+		*key = _key;
+	return val;
+}
+
+static inline void *CBTREE_FN(get_next)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE *key)
+{
+	unsigned long _key = *key;
+	void *val = cbtree_get_next(&head->h, CBTREE_TYPE_GEO, &_key);
+	if (val)
+		*key = _key;
+	return val;
+}
+
+static inline size_t CBTREE_FN(lookup_batch)(CBTREE_TYPE_HEAD *head,
+		const CBTREE_KEYTYPE *keys, void **vals, size_t n)
+{
+	unsigned long _keys[CBTREE_BATCH_GROUP];
+	size_t i, j, len, found = 0;
+
+	for (i = 0; i < n; i += len) {
+		len = min_t(size_t, n - i, CBTREE_BATCH_GROUP);
+		for (j = 0; j < len; j++)
+			_keys[j] = keys[i + j];
+		found += cbtree_lookup_batch(&head->h, CBTREE_TYPE_GEO, _keys,
+				&vals[i], len);
+	}
+	return found;
+}
+
+static inline void *CBTREE_FN(iter_first)(CBTREE_TYPE_HEAD *head,
+		struct cbtree_iter *iter, CBTREE_KEYTYPE lo, CBTREE_KEYTYPE hi,
+		CBTREE_KEYTYPE *key)
+{
+	unsigned long _lo = lo, _hi = hi, _key;
+	void *val = cbtree_iter_first(&head->h, CBTREE_TYPE_GEO, iter, &_lo,
+			&_hi, &_key);
+	if (val)
+		*key = _key;
+	return val;
+}
+
+static inline void *CBTREE_FN(iter_next)(struct cbtree_iter *iter,
+		CBTREE_KEYTYPE *key)
+{
+	unsigned long _key;
+	void *val = cbtree_iter_next(iter, &_key);
+	if (val)
+		*key = _key;
+	return val;
+}
+
+static inline void *CBTREE_FN(iter_last)(CBTREE_TYPE_HEAD *head,
+		struct cbtree_iter *iter, CBTREE_KEYTYPE lo, CBTREE_KEYTYPE hi,
+		CBTREE_KEYTYPE *key)
+{
+	unsigned long _lo = lo, _hi = hi, _key;
+	void *val = cbtree_iter_last(&head->h, CBTREE_TYPE_GEO, iter, &_lo,
+			&_hi, &_key);
+	if (val)
+		*key = _key;
+	return val;
+}
+
+static inline void *CBTREE_FN(iter_prev)(struct cbtree_iter *iter,
+		CBTREE_KEYTYPE *key)
+{
+	unsigned long _key;
+	void *val = cbtree_iter_prev(iter, &_key);
+	if (val)
+		*key = _key;
+	return val;
+}
+
+static inline int CBTREE_FN(bulk_load)(CBTREE_TYPE_HEAD *head,
+		const CBTREE_KEYTYPE *keys, void **vals, size_t n,
+		int fill_factor)
+{
+	unsigned long *_keys;
+	size_t i;
+	int err;
+
+	_keys = kvmalloc_array(n, sizeof(*_keys), GFP_KERNEL);
+	if (!_keys)
+		return -ENOMEM;
+	for (i = 0; i < n; i++)
+		_keys[i] = keys[i];
+	err = cbtree_bulk_load(&head->h, CBTREE_TYPE_GEO, _keys, vals, n,
+			fill_factor);
+	kvfree(_keys);
+	return err;
+}
 #else
+static inline int CBTREE_FN(split)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key,
+				  CBTREE_TYPE_HEAD *out, gfp_t gfp)
+{
+	return cbtree_split(&head->h, CBTREE_TYPE_GEO, (unsigned long *)&key,
+			&out->h, gfp);
+}
+
 static inline void *CBTREE_FN(lookup)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key)
 {
-	return cbtree_lookup(&head->h, CBTREE_TYPE_GEO, (unsigned long *)&key);
+	return CBTREE_SPEC_FN(lookup)(&head->h, (unsigned long *)&key);
 }
 
 static inline int CBTREE_FN(insert)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key,
 			   void *val, gfp_t gfp)
 {
-	return cbtree_insert(&head->h, CBTREE_TYPE_GEO, (unsigned long *)&key,
-			    val, gfp);
+	return CBTREE_SPEC_FN(insert)(&head->h, (unsigned long *)&key,
+				     val, gfp);
 }
 
 static inline int CBTREE_FN(update)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key,
@@ -99,7 +222,7 @@ static inline int CBTREE_FN(update)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key,
 
 static inline void *CBTREE_FN(remove)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE key)
 {
-	return cbtree_remove(&head->h, CBTREE_TYPE_GEO, (unsigned long *)&key);
+	return CBTREE_SPEC_FN(remove)(&head->h, (unsigned long *)&key);
 }
 
 static inline void *CBTREE_FN(last)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE *key)
@@ -111,6 +234,61 @@ static inline void *CBTREE_FN(get_prev)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE *
 {
 	return cbtree_get_prev(&head->h, CBTREE_TYPE_GEO, (unsigned long *)key);
 }
+
+static inline void *CBTREE_FN(first)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE *key)
+{
+	return cbtree_first(&head->h, CBTREE_TYPE_GEO, (unsigned long *)key);
+}
+
+static inline void *CBTREE_FN(get_next)(CBTREE_TYPE_HEAD *head, CBTREE_KEYTYPE *key)
+{
+	return cbtree_get_next(&head->h, CBTREE_TYPE_GEO, (unsigned long *)key);
+}
+
+static inline size_t CBTREE_FN(lookup_batch)(CBTREE_TYPE_HEAD *head,
+		const CBTREE_KEYTYPE *keys, void **vals, size_t n)
+{
+	return cbtree_lookup_batch(&head->h, CBTREE_TYPE_GEO,
+			(unsigned long *)keys, vals, n);
+}
+
+static inline void *CBTREE_FN(iter_first)(CBTREE_TYPE_HEAD *head,
+		struct cbtree_iter *iter, CBTREE_KEYTYPE lo, CBTREE_KEYTYPE hi,
+		CBTREE_KEYTYPE *key)
+{
+	return cbtree_iter_first(&head->h, CBTREE_TYPE_GEO, iter,
+			(unsigned long *)&lo, (unsigned long *)&hi,
+			(unsigned long *)key);
+}
+
+static inline void *CBTREE_FN(iter_next)(struct cbtree_iter *iter,
+		CBTREE_KEYTYPE *key)
+{
+	return cbtree_iter_next(iter, (unsigned long *)key);
+}
+
+static inline void *CBTREE_FN(iter_last)(CBTREE_TYPE_HEAD *head,
+		struct cbtree_iter *iter, CBTREE_KEYTYPE lo, CBTREE_KEYTYPE hi,
+		CBTREE_KEYTYPE *key)
+{
+	return cbtree_iter_last(&head->h, CBTREE_TYPE_GEO, iter,
+			(unsigned long *)&lo, (unsigned long *)&hi,
+			(unsigned long *)key);
+}
+
+static inline void *CBTREE_FN(iter_prev)(struct cbtree_iter *iter,
+		CBTREE_KEYTYPE *key)
+{
+	return cbtree_iter_prev(iter, (unsigned long *)key);
+}
+
+static inline int CBTREE_FN(bulk_load)(CBTREE_TYPE_HEAD *head,
+		const CBTREE_KEYTYPE *keys, void **vals, size_t n,
+		int fill_factor)
+{
+	return cbtree_bulk_load(&head->h, CBTREE_TYPE_GEO,
+			(unsigned long *)keys, vals, n, fill_factor);
+}
 #endif
 
 void VISITOR_FN(void *elem, unsigned long opaque, unsigned long *key,
@@ -119,6 +297,30 @@ void VISITOR_FN(void *elem, unsigned long opaque, unsigned long *key,
 typedef void (*VISITOR_FN_T)(void *elem, unsigned long opaque,
 			     CBTREE_KEYTYPE key, size_t index);
 
+void CBTREE_TP(cvisitor)(void *elem, unsigned long opaque, unsigned long *key,
+		size_t index, void *__func);
+
+#if (BITS_PER_LONG > CBTREE_TYPE_BITS)
+static inline size_t CBTREE_FN(remove_range)(CBTREE_TYPE_HEAD *head,
+		CBTREE_KEYTYPE lo, CBTREE_KEYTYPE hi, unsigned long opaque,
+		VISITOR_FN_T func2)
+{
+	unsigned long _lo = lo, _hi = hi;
+
+	return cbtree_remove_range(&head->h, CBTREE_TYPE_GEO, &_lo, &_hi,
+			opaque, func2 ? CBTREE_TP(cvisitor) : NULL, func2);
+}
+#else
+static inline size_t CBTREE_FN(remove_range)(CBTREE_TYPE_HEAD *head,
+		CBTREE_KEYTYPE lo, CBTREE_KEYTYPE hi, unsigned long opaque,
+		VISITOR_FN_T func2)
+{
+	return cbtree_remove_range(&head->h, CBTREE_TYPE_GEO,
+			(unsigned long *)&lo, (unsigned long *)&hi,
+			opaque, func2 ? CBTREE_TP(cvisitor) : NULL, func2);
+}
+#endif
+
 static inline size_t CBTREE_FN(visitor)(CBTREE_TYPE_HEAD *head,
 				       unsigned long opaque,
 				       VISITOR_FN_T func2)
@@ -141,6 +343,8 @@ static inline size_t CBTREE_FN(grim_visitor)(CBTREE_TYPE_HEAD *head,
 #undef _CBTREE_TP
 #undef CBTREE_TP
 #undef CBTREE_FN
+#undef CBTREE_SPEC_FN
+#undef CBTREE_TYPE_SPEC
 #undef CBTREE_TYPE_HEAD
 #undef CBTREE_TYPE_SUFFIX
 #undef CBTREE_TYPE_GEO
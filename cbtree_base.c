@@ -39,83 +39,454 @@
 
 #include "cbtree_base.h"
 #include "cbtree_cache.h"
+#include "cbtree_simd.h"
 #include <linux/cache.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/module.h>
+#include <linux/atomic.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
+#include <linux/prefetch.h>
+#include <linux/rcupdate.h>
 
 // #define MAX(a, b) ((a) > (b) ? (a) : (b))
 // #define NODESIZE MAX(L1_CACHE_BYTES, 128)
-#define CACHE_LENTH 3   // 1 for cache queue 1 for count 1 for to check is it deleted
-//#define CACHE_START ->no_pairs + geo->no_longs
+#define CACHE_LENTH 3   // version word and 2 leaf links
+/* the trailer slots in cbtree_cache.h follow the values */
+#define CACHE_START(geo) ((geo)->no_longs + (geo)->no_pairs)
 
-struct cbtree_geo {
-	int keylen;
-	int no_pairs;
-	int no_longs;
-};
+#define LONG_PER_U64 (64 / BITS_PER_LONG)
+#define NODE_LONGS(size)	((size) / sizeof(long) - CACHE_LENTH)
 
-struct cbtree_geo cbtree_geo32 = {
-	.keylen = 1,
-	.no_pairs = (NODESIZE - CACHE_LENTH) / sizeof(long) / 2,
-	.no_longs = (NODESIZE - CACHE_LENTH) / sizeof(long) / 2,
-};
+#define CBTREE_GEO_INIT(len, size) {					\
+	.keylen = (len),						\
+	.no_pairs = NODE_LONGS(size) / (1 + (len)),			\
+	.no_longs = (len) * (NODE_LONGS(size) / (1 + (len))),		\
+	.nodesize = (size),						\
+}
+
+/* a pair is a u32 key and a long value, the keys are padded to a long */
+#define PACKED_PAIRS(size)	\
+	(NODE_LONGS(size) * sizeof(long) / (sizeof(u32) + sizeof(long)))
+
+#define CBTREE_GEO_PACKED_INIT(size) {					\
+	.keylen = 1,							\
+	.no_pairs = PACKED_PAIRS(size),					\
+	.no_longs = DIV_ROUND_UP(PACKED_PAIRS(size) * sizeof(u32), sizeof(long)), \
+	.nodesize = (size),						\
+	.packed = true,							\
+}
+
+struct cbtree_geo cbtree_geo32 = CBTREE_GEO_INIT(1, NODESIZE);
 EXPORT_SYMBOL_GPL(cbtree_geo32);
 
-#define LONG_PER_U64 (64 / BITS_PER_LONG)
-struct cbtree_geo cbtree_geo64 = {
-	.keylen = LONG_PER_U64,
-	.no_pairs = (NODESIZE - CACHE_LENTH) / sizeof(long) / (1 + LONG_PER_U64),
-	.no_longs = LONG_PER_U64 * ((NODESIZE - CACHE_LENTH) / sizeof(long) / (1 + LONG_PER_U64)),
-};
+struct cbtree_geo cbtree_geo32p = CBTREE_GEO_PACKED_INIT(NODESIZE);
+EXPORT_SYMBOL_GPL(cbtree_geo32p);
+
+struct cbtree_geo cbtree_geo64 = CBTREE_GEO_INIT(LONG_PER_U64, NODESIZE);
 EXPORT_SYMBOL_GPL(cbtree_geo64);
 
-struct cbtree_geo cbtree_geo128 = {
-	.keylen = 2 * LONG_PER_U64,
-	.no_pairs = (NODESIZE - CACHE_LENTH) / sizeof(long) / (1 + 2 * LONG_PER_U64),
-	.no_longs = 2 * LONG_PER_U64 * ((NODESIZE - CACHE_LENTH) / sizeof(long) / (1 + 2 * LONG_PER_U64)),
-};
+struct cbtree_geo cbtree_geo128 = CBTREE_GEO_INIT(2 * LONG_PER_U64, NODESIZE);
 EXPORT_SYMBOL_GPL(cbtree_geo128);
 
 #define MAX_KEYLEN	(2 * LONG_PER_U64)
 
-// static struct kmem_cache *cbtree_cachep;
+/* inner nodes remembered per lookup for setting their caches */
+#define CBTREE_MAX_PATH	32
+
+/*
+ * Nodes with at least this many pairs are searched with a binary search,
+ * smaller ones with the original linear scan.  0 forces binary search for
+ * every geometry, INT_MAX forces the linear scan.
+ */
+int cbtree_bsearch_pairs __read_mostly = CBTREE_BSEARCH_PAIRS;
+EXPORT_SYMBOL_GPL(cbtree_bsearch_pairs);
+module_param_named(bsearch_pairs, cbtree_bsearch_pairs, int, 0644);
+MODULE_PARM_DESC(bsearch_pairs, "minimum no_pairs for binary in-node search");
+
+int cbtree_limbo_nodes __read_mostly = CBTREE_LIMBO_NODES;
+EXPORT_SYMBOL_GPL(cbtree_limbo_nodes);
+module_param_named(limbo_nodes, cbtree_limbo_nodes, int, 0644);
+MODULE_PARM_DESC(limbo_nodes, "unlinked nodes a tree frees at once");
+
+int cbtree_cache_fill __read_mostly = CBTREE_CACHE_FILL;
+EXPORT_SYMBOL_GPL(cbtree_cache_fill);
+module_param_named(cache_fill, cbtree_cache_fill, int, 0644);
+MODULE_PARM_DESC(cache_fill, "node cache misses per CPU for one fill");
+
+/* source of cache epochs, so that no two trees ever share one */
+static atomic_long_t cbtree_epoch = ATOMIC_LONG_INIT(0);
+
+#ifdef CBTREE_KEYCMP_STATS
+DEFINE_PER_CPU(unsigned long, cbtree_keycmp_nr);
+EXPORT_PER_CPU_SYMBOL_GPL(cbtree_keycmp_nr);
+
+unsigned long cbtree_keycmp_count(void)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(cbtree_keycmp_nr, cpu);
+	return sum;
+}
+EXPORT_SYMBOL_GPL(cbtree_keycmp_count);
+
+void cbtree_keycmp_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		per_cpu(cbtree_keycmp_nr, cpu) = 0;
+}
+EXPORT_SYMBOL_GPL(cbtree_keycmp_reset);
+#endif
 
+/*
+ * @pool_data is the tree's own node cache for trees set up with
+ * cbtree_init_nodesize(), NULL for the shared cbtree_cachep.
+ */
 void *cbtree_alloc(gfp_t gfp_mask, void *pool_data)
-{	
-	// printk("%d",cbtree_cachep);
-	return kmem_cache_alloc(cbtree_cachep, gfp_mask);	
-	// printk("break");
+{
+	return kmem_cache_alloc(pool_data ?: cbtree_cachep, gfp_mask);
 }
 EXPORT_SYMBOL_GPL(cbtree_alloc);
 
 void cbtree_free(void *element, void *pool_data)
 {
-	kmem_cache_free(cbtree_cachep, element);
+	kmem_cache_free(pool_data ?: cbtree_cachep, element);
 }
 EXPORT_SYMBOL_GPL(cbtree_free);
 
+/*
+ * Trees with their own node size carry their own geometry, which replaces
+ * the one passed in by the caller.
+ */
+static inline struct cbtree_geo *tree_geo(struct cbtree_head *head,
+		struct cbtree_geo *geo)
+{
+	return head->cachep ? &head->geo : geo;
+}
+
+/*
+ * Hot-key table, see cbtree_init_hot().  Keys hash to a window of
+ * CBTREE_HOT_PROBE entries.  An entry is only valid while its gen matches
+ * the table's, which moves on whenever a node is freed or nodes change
+ * trees, so the leaf of a valid entry is still a leaf of this tree.  Keys
+ * may have moved between leaves since, so the slot is only a hint.
+ */
+#define CBTREE_HOT_PROBE	4
+
+struct cbtree_hot_entry {
+	unsigned long key[MAX_KEYLEN];
+	unsigned long *leaf;
+	unsigned int slot;
+	unsigned int gen;
+};
+
+struct cbtree_hot {
+	unsigned int bits;
+	unsigned int gen;
+	unsigned int hand;
+	struct cbtree_hot_entry e[];
+};
+
+/*
+ * Per-CPU finger: the leaf the last lookup on this CPU ended in, valid
+ * while @gen matches the tree's node_gen.
+ */
+struct cbtree_finger {
+	unsigned long *leaf;
+	u64 gen;
+};
+
+/* a node was freed or moved to another tree, forget pointers to leaves */
+static void nodes_changed(struct cbtree_head *head)
+{
+	struct cbtree_hot *hot = head->hot;
+
+	head->node_gen++;
+	if (!hot || ++hot->gen)
+		return;
+	/* gen wrapped, entries from the last round could look valid */
+	memset(hot->e, 0, sizeof(hot->e[0]) << hot->bits);
+	hot->gen = 1;
+}
+
+static void node_init(struct cbtree_geo *geo, unsigned long *node)
+{
+	memset(node, 0, geo->nodesize);
+	initQueue(nodeCache(node, geo->nodesize));
+	/* lockless readers must not see the old contents once it is linked */
+	smp_wmb();
+}
+
 static unsigned long *cbtree_node_alloc(struct cbtree_head *head, struct cbtree_geo* geo,gfp_t gfp)
 {
-	unsigned long *node;
-	//printk("2-1-1");
-	// printk("%d",cbtree_cachep);
-	node = mempool_alloc(head->mempool, gfp);
-	//printk("2-1-2");
-	if (likely(node))
-		memset(node, 0, NODESIZE);
-	if (!node) {
-    	// printk(KERN_ERR "mempool_alloc failed to allocate memory for node\n");
-    	return node;
-	}
-	//printk("2-1-3");
-	initQueue(&node[geo->keylen * geo->no_pairs + geo->no_longs]);
-	// printk("%d",node[geo->keylen * geo->no_pairs + geo->no_longs]);
-	//printk("2-1-4");
+	unsigned long *node = head->reserve;
+
+	if (node) {
+		head->reserve = (unsigned long *)node[0];
+		head->reserve_nr--;
+	} else {
+		node = mempool_alloc(head->mempool, gfp);
+		if (!node)
+			return NULL;
+	}
+	node_init(geo, node);
 	return node;
 }
 
-static int longcmp(const unsigned long *l1, const unsigned long *l2, size_t n)
+/* the limbo list and the reserve are linked through the first word */
+static void nodes_free(unsigned long *next, mempool_t *mempool)
+{
+	unsigned long *node;
+
+	while (next) {
+		node = next;
+		next = (unsigned long *)node[0];
+		mempool_free(node, mempool);
+	}
+}
+
+/*
+ * A limbo list of a CBTREE_RCU tree waiting for readers to leave it.  It
+ * lives in the cache slots of the first node on the list, which lockless
+ * readers never look at.
+ */
+struct cbtree_limbo {
+	struct rcu_head rcu;
+	unsigned long *list;
+	mempool_t *mempool;
+};
+
+static void limbo_free_rcu(struct rcu_head *rcu)
+{
+	struct cbtree_limbo *l = container_of(rcu, struct cbtree_limbo, rcu);
+
+	nodes_free(l->list, l->mempool);
+}
+
+static void limbo_flush(struct cbtree_head *head)
+{
+	struct cbtree_limbo *l;
+
+	BUILD_BUG_ON(sizeof(struct cbtree_limbo) > CBTREE_CACHE_BYTES);
+	/* empty every queue filled before, they may point into the list */
+	head->cache_epoch = atomic_long_inc_return(&cbtree_epoch);
+	if (head->limbo && (head->flags & CBTREE_RCU)) {
+		l = (struct cbtree_limbo *)nodeCache(head->limbo,
+				head->cachep ? head->geo.nodesize : NODESIZE);
+		l->list = head->limbo;
+		l->mempool = head->mempool;
+		call_rcu(&l->rcu, limbo_free_rcu);
+	} else {
+		nodes_free(head->limbo, head->mempool);
+	}
+	head->limbo = NULL;
+	head->limbo_nr = 0;
+}
+
+/*
+ * Take the nodes the next write section of a CBTREE_RCU tree may need
+ * while sleeping is still allowed.  cbtree_node_alloc() uses them first.
+ */
+static int cbtree_reserve(struct cbtree_head *head, unsigned int nr, gfp_t gfp)
+{
+	unsigned long *node;
+
+	while (head->reserve_nr < nr) {
+		node = mempool_alloc(head->mempool, gfp);
+		if (!node)
+			return -ENOMEM;
+		node[0] = (unsigned long)head->reserve;
+		head->reserve = node;
+		head->reserve_nr++;
+	}
+	return 0;
+}
+
+static void reserve_free(struct cbtree_head *head)
+{
+	nodes_free(head->reserve, head->mempool);
+	head->reserve = NULL;
+	head->reserve_nr = 0;
+}
+
+/* wait for the writers that lock single nodes to leave @head */
+static void writers_drain(struct cbtree_head *head)
+{
+	int cpu;
+
+	/* pairs with the barrier in olc_enter() */
+	smp_mb();
+	for_each_possible_cpu(cpu)
+		while (READ_ONCE(*per_cpu_ptr(head->writers, cpu)))
+			cpu_relax();
+}
+
+/*
+ * Writers of a CBTREE_RCU tree hold head->lock and change the tree between
+ * these two.  Readers spin while write_seq is odd, so the writer must not
+ * be preempted in between, and can only allocate without sleeping.  The
+ * writers that lock single nodes back off while write_seq is odd, the
+ * ones already inside are waited for.
+ */
+static void cbtree_write_begin(struct cbtree_head *head, int subclass)
+{
+	preempt_disable();
+	write_seqcount_begin_nested(&head->write_seq, subclass);
+	if (head->writers)
+		writers_drain(head);
+}
+
+static void cbtree_write_end(struct cbtree_head *head)
+{
+	write_seqcount_end(&head->write_seq);
+	preempt_enable();
+}
+
+/*
+ * Replace the root of @head.  cbtree_read() loads the root before the
+ * height, so a reader that sees the new root sees its height too.
+ */
+static inline void set_root(struct cbtree_head *head, unsigned long *node,
+		int height)
+{
+	WRITE_ONCE(head->height, height);
+	smp_store_release(&head->node, node);
+}
+
+static inline gfp_t cbtree_write_gfp(gfp_t gfp)
+{
+	return gfp & ~__GFP_DIRECT_RECLAIM;
+}
+
+/*
+ * Keep the writers that lock single nodes out of a CBTREE_RCU tree while
+ * the holder of head->lock reads it, or builds new nodes for it, outside
+ * of a write section.  The readers go on meanwhile; the changes themselves
+ * still go in write sections, each short enough to hold them up briefly.
+ */
+static void cbtree_writers_stop(struct cbtree_head *head)
+{
+	if (!head->writers)
+		return;
+	WRITE_ONCE(head->writers_stopped, true);
+	writers_drain(head);
+}
+
+static void cbtree_writers_start(struct cbtree_head *head)
+{
+	WRITE_ONCE(head->writers_stopped, false);
+}
+
+/*
+ * Writers of a CBTREE_RCU tree that lock single nodes run between these
+ * two, counted in head->writers, and never while write_seq is odd or the
+ * writers are stopped.  They do not free nodes, so the nodes they reach
+ * stay allocated without rcu_read_lock().
+ */
+static void olc_enter(struct cbtree_head *head)
+{
+	for (;;) {
+		preempt_disable();
+		this_cpu_inc(*head->writers);
+		/* pairs with the barrier in writers_drain() */
+		smp_mb();
+		if (!(raw_read_seqcount(&head->write_seq) & 1) &&
+		    !READ_ONCE(head->writers_stopped))
+			return;
+		this_cpu_dec(*head->writers);
+		preempt_enable();
+		/* sleep until the writer holding the tree is done */
+		mutex_lock(&head->lock);
+		mutex_unlock(&head->lock);
+	}
+}
+
+static void olc_exit(struct cbtree_head *head)
+{
+	this_cpu_dec(*head->writers);
+	preempt_enable();
+}
+
+/* outcome of a writer that locks single nodes */
+#define OLC_DONE	0
+#define OLC_RESTART	1	/* a node changed under it */
+#define OLC_ALLOC	2	/* it needs a node for a split */
+#define OLC_EXCL	3	/* the change needs the write_seq section */
+
+/*
+ * Free a node that was unlinked from the tree.  Cache entries may still
+ * point at it, so it is only marked retired and put on the limbo list,
+ * which is freed in one go once cbtree_limbo_nodes nodes are on it.
+ */
+static void cbtree_free_node(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *node)
+{
+	nodes_changed(head);
+	node[CACHE_START(geo) + NODE_VERSION] |= NODE_RETIRED;
+	node[0] = (unsigned long)head->limbo;
+	head->limbo = node;
+	if (++head->limbo_nr >= cbtree_limbo_nodes)
+		limbo_flush(head);
+}
+
+/*
+ * Nodes of @head moved to another tree.  Their queues keep the entries of
+ * this epoch, which must not count again if the nodes ever come back.
+ */
+static void nodes_moved(struct cbtree_head *head)
+{
+	nodes_changed(head);
+	limbo_flush(head);
+}
+
+static inline unsigned long *leaf_next(struct cbtree_geo *geo,
+		unsigned long *leaf)
+{
+	return (unsigned long *)leaf[CACHE_START(geo) + LEAF_NEXT];
+}
+
+static inline unsigned long *leaf_prev(struct cbtree_geo *geo,
+		unsigned long *leaf)
+{
+	return (unsigned long *)leaf[CACHE_START(geo) + LEAF_PREV];
+}
+
+static inline void leaf_set_next(struct cbtree_geo *geo, unsigned long *leaf,
+		unsigned long *next)
+{
+	if (leaf)
+		leaf[CACHE_START(geo) + LEAF_NEXT] = (unsigned long)next;
+}
+
+static inline void leaf_set_prev(struct cbtree_geo *geo, unsigned long *leaf,
+		unsigned long *prev)
+{
+	if (leaf)
+		leaf[CACHE_START(geo) + LEAF_PREV] = (unsigned long)prev;
+}
+
+/* @new takes the keys just above those of @leaf */
+static void leaf_link_next(struct cbtree_geo *geo, unsigned long *leaf,
+		unsigned long *new)
+{
+	leaf_set_prev(geo, new, leaf);
+	leaf_set_next(geo, new, leaf_next(geo, leaf));
+	leaf_set_prev(geo, leaf_next(geo, leaf), new);
+	leaf_set_next(geo, leaf, new);
+}
+
+static void leaf_unlink(struct cbtree_geo *geo, unsigned long *leaf)
+{
+	leaf_set_next(geo, leaf_prev(geo, leaf), leaf_next(geo, leaf));
+	leaf_set_prev(geo, leaf_next(geo, leaf), leaf_prev(geo, leaf));
+}
+
+static __always_inline int longcmp(const unsigned long *l1, const unsigned long *l2, size_t n)
 {
 	size_t i;
 
@@ -128,7 +499,7 @@ static int longcmp(const unsigned long *l1, const unsigned long *l2, size_t n)
 	return 0;
 }
 
-static unsigned long *longcpy(unsigned long *dest, const unsigned long *src,
+static __always_inline unsigned long *longcpy(unsigned long *dest, const unsigned long *src,
 		size_t n)
 {
 	size_t i;
@@ -138,7 +509,7 @@ static unsigned long *longcpy(unsigned long *dest, const unsigned long *src,
 	return dest;
 }
 
-static unsigned long *longset(unsigned long *s, unsigned long c, size_t n)
+static __always_inline unsigned long *longset(unsigned long *s, unsigned long c, size_t n)
 {
 	size_t i;
 
@@ -147,666 +518,2980 @@ static unsigned long *longset(unsigned long *s, unsigned long c, size_t n)
 	return s;
 }
 
-static void dec_key(struct cbtree_geo *geo, unsigned long *key)
-{
-	unsigned long val;
-	int i;
 
-	for (i = geo->keylen - 1; i >= 0; i--) {
-		val = key[i];
-		key[i] = val - 1;
-		if (val)
-			break;
-	}
+
+/*
+ * Packed geometries store each key as a u32 at the start of the node, the
+ * values start at the next long boundary (geo->no_longs).  Their keylen is
+ * 1, callers still pass keys as one unsigned long.  bkey() must not be used
+ * on them, go through getkey(), setkey(), keycmp() and movepair().
+ */
+static __always_inline u32 *bkey32(unsigned long *node, int n)
+{
+	return &((u32 *)node)[n];
 }
 
-static unsigned long *bkey(struct cbtree_geo *geo, unsigned long *node, int n)
+static __always_inline unsigned long *bkey(struct cbtree_geo *geo, unsigned long *node, int n)
 {
 	return &node[n * geo->keylen];
 }
 
-static void *bval(struct cbtree_geo *geo, unsigned long *node, int n)
+static __always_inline void getkey(struct cbtree_geo *geo, unsigned long *node,
+		int n, unsigned long *key)
+{
+	if (geo->packed)
+		key[0] = *bkey32(node, n);
+	else
+		longcpy(key, bkey(geo, node, n), geo->keylen);
+}
+
+static __always_inline void *bval(struct cbtree_geo *geo, unsigned long *node, int n)
 {
 	return (void *)node[geo->no_longs + n];
 }
 
-static void setkey(struct cbtree_geo *geo, unsigned long *node, int n,
+/* bval() of an inner node, for readers racing with a writer */
+static __always_inline unsigned long *node_child(struct cbtree_geo *geo,
+		unsigned long *node, int n)
+{
+	return (unsigned long *)READ_ONCE(node[geo->no_longs + n]);
+}
+
+/*
+ * Optimistic lock coupling on the version word of a node.  A reader takes
+ * the version with node_read_lock(), reads the node, and only trusts what
+ * it read if node_read_check() finds the same version.  A writer upgrades
+ * the version it read to a lock, which fails if anyone changed the node in
+ * between, and moves it on when it unlocks.
+ */
+static __always_inline unsigned long *node_version(struct cbtree_geo *geo,
+		unsigned long *node)
+{
+	return &node[CACHE_START(geo) + NODE_VERSION];
+}
+
+/* wait for the writer of @node to finish, false if @node left the tree */
+static __always_inline bool node_read_lock(struct cbtree_geo *geo,
+		unsigned long *node, unsigned long *v)
+{
+	while ((*v = smp_load_acquire(node_version(geo, node))) & NODE_LOCKED)
+		cpu_relax();
+	return !(*v & NODE_RETIRED);
+}
+
+static __always_inline bool node_read_check(struct cbtree_geo *geo,
+		unsigned long *node, unsigned long v)
+{
+	smp_rmb();
+	return READ_ONCE(*node_version(geo, node)) == v;
+}
+
+static __always_inline bool node_upgrade(struct cbtree_geo *geo,
+		unsigned long *node, unsigned long v)
+{
+	return cmpxchg(node_version(geo, node), v, v | NODE_LOCKED) == v;
+}
+
+static __always_inline void node_write_unlock(struct cbtree_geo *geo,
+		unsigned long *node)
+{
+	unsigned long *v = node_version(geo, node);
+
+	smp_store_release(v, *v - NODE_LOCKED + NODE_VERSION_STEP);
+}
+
+static __always_inline void setkey(struct cbtree_geo *geo, unsigned long *node, int n,
 		   unsigned long *key)
 {
-	longcpy(bkey(geo, node, n), key, geo->keylen);
+	if (geo->packed)
+		*bkey32(node, n) = key[0];
+	else
+		longcpy(bkey(geo, node, n), key, geo->keylen);
 }
 
-static void setval(struct cbtree_geo *geo, unsigned long *node, int n,
+static __always_inline void setval(struct cbtree_geo *geo, unsigned long *node, int n,
 		   void *val)
 {
 	node[geo->no_longs + n] = (unsigned long) val;
 }
 
-static void clearpair(struct cbtree_geo *geo, unsigned long *node, int n)
+static __always_inline void clearpair(struct cbtree_geo *geo, unsigned long *node, int n)
 {
-	longset(bkey(geo, node, n), 0, geo->keylen);
+	if (geo->packed)
+		*bkey32(node, n) = 0;
+	else
+		longset(bkey(geo, node, n), 0, geo->keylen);
 	node[geo->no_longs + n] = 0;
 }
 
+/* copy pair @sn of @src to pair @dn of @dst */
+static __always_inline void movepair(struct cbtree_geo *geo,
+		unsigned long *dst, int dn, unsigned long *src, int sn)
+{
+	if (geo->packed)
+		*bkey32(dst, dn) = *bkey32(src, sn);
+	else
+		longcpy(bkey(geo, dst, dn), bkey(geo, src, sn), geo->keylen);
+	dst[geo->no_longs + dn] = src[geo->no_longs + sn];
+}
+
 static inline void __cbtree_init(struct cbtree_head *head)
 {
 	head->node = NULL;
 	head->height = 0;
+	/* lockless readers may still run, they must keep the RCU paths */
+	head->flags &= CBTREE_RCU;
+	head->append_fill = 0;
+	head->seq = 0;
+	head->cursor = NULL;
+	head->cache_policy = CBTREE_CACHE_RR;
+	memset(head->cache_ways, 0, sizeof(head->cache_ways));
+	nodes_changed(head);
+}
+
+/*
+ * State that stays with the head when the tree is emptied by the grim
+ * visitor or a merge, set up once by the init functions.
+ */
+static void cbtree_init_head(struct cbtree_head *head)
+{
+	head->flags = 0;
+	head->hot = NULL;
+	head->node_gen = 0;
+	head->cache_epoch = atomic_long_inc_return(&cbtree_epoch);
+	head->limbo = NULL;
+	head->limbo_nr = 0;
+	head->reserve = NULL;
+	head->reserve_nr = 0;
+	head->writers_stopped = false;
+	mutex_init(&head->lock);
+	seqcount_init(&head->write_seq);
 }
 
 void cbtree_init_mempool(struct cbtree_head *head, mempool_t *mempool)
 {
+	cbtree_init_head(head);
+	head->finger = NULL;
+	head->writers = NULL;
 	__cbtree_init(head);
 	head->mempool = mempool;
+	head->cachep = NULL;
 }
 EXPORT_SYMBOL_GPL(cbtree_init_mempool);
 
 int cbtree_init(struct cbtree_head *head)
 {
+	cbtree_init_head(head);
 	__cbtree_init(head);
-	// printk("init done");
+	head->cachep = NULL;
+	head->finger = alloc_percpu(struct cbtree_finger);
+	if (!head->finger)
+		return -ENOMEM;
+	head->writers = alloc_percpu(unsigned int);
+	if (!head->writers)
+		goto free_finger;
 	head->mempool = mempool_create(0, cbtree_alloc, cbtree_free, NULL);
 	if (!head->mempool)
-		// printk("NULL returnd");
-		return -ENOMEM;
+		goto free_writers;
 	return 0;
+
+free_writers:
+	free_percpu(head->writers);
+free_finger:
+	free_percpu(head->finger);
+	return -ENOMEM;
 }
 EXPORT_SYMBOL_GPL(cbtree_init);
 
+int cbtree_init_nodesize(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned int nodesize)
+{
+	static atomic_t id = ATOMIC_INIT(0);
+
+	if (nodesize != PAGE_SIZE &&
+	    (nodesize < 128 || nodesize > 1024 || !is_power_of_2(nodesize)))
+		return -EINVAL;
+
+	cbtree_init_head(head);
+	if (geo->packed)
+		head->geo = (struct cbtree_geo)CBTREE_GEO_PACKED_INIT(nodesize);
+	else
+		head->geo = (struct cbtree_geo)CBTREE_GEO_INIT(geo->keylen, nodesize);
+
+	head->cachep_name = kasprintf(GFP_KERNEL, "cbtree_node_%u_%d", nodesize,
+			atomic_inc_return(&id));
+	if (!head->cachep_name)
+		return -ENOMEM;
+	head->cachep = kmem_cache_create(head->cachep_name,
+			CBTREE_NODE_BYTES(nodesize), 0,
+			SLAB_HWCACHE_ALIGN, NULL);
+	if (!head->cachep)
+		goto free_name;
+
+	__cbtree_init(head);
+	head->finger = alloc_percpu(struct cbtree_finger);
+	if (!head->finger)
+		goto free_cache;
+	head->writers = alloc_percpu(unsigned int);
+	if (!head->writers)
+		goto free_finger;
+	head->mempool = mempool_create(0, cbtree_alloc, cbtree_free,
+			head->cachep);
+	if (!head->mempool)
+		goto free_writers;
+	return 0;
+
+free_writers:
+	free_percpu(head->writers);
+free_finger:
+	free_percpu(head->finger);
+free_cache:
+	kmem_cache_destroy(head->cachep);
+	head->cachep = NULL;
+free_name:
+	kfree(head->cachep_name);
+	return -ENOMEM;
+}
+EXPORT_SYMBOL_GPL(cbtree_init_nodesize);
+
 void cbtree_destroy(struct cbtree_head *head)
 {
+	limbo_flush(head);
+	reserve_free(head);
+	/* batches of limbo nodes still waiting for their grace period */
+	if (head->flags & CBTREE_RCU)
+		rcu_barrier();
 	mempool_free(head->node, head->mempool);
 	mempool_destroy(head->mempool);
 	head->mempool = NULL;
+	if (head->cachep) {
+		kmem_cache_destroy(head->cachep);
+		kfree(head->cachep_name);
+		head->cachep = NULL;
+	}
+	kvfree(head->hot);
+	head->hot = NULL;
+	free_percpu(head->finger);
+	head->finger = NULL;
+	free_percpu(head->writers);
+	head->writers = NULL;
 }
 EXPORT_SYMBOL_GPL(cbtree_destroy);
 
-void *cbtree_last(struct cbtree_head *head, struct cbtree_geo *geo,
-		 unsigned long *key)
+int cbtree_init_hot(struct cbtree_head *head, size_t budget)
 {
-	int height = head->height;
-	unsigned long *node = head->node;
-
-	if (height == 0)
-		return NULL;
-
-	for ( ; height > 1; height--)
-		node = bval(geo, node, 0);
-
-	longcpy(key, bkey(geo, node, 0), geo->keylen);
-	return bval(geo, node, 0);
+	struct cbtree_hot *hot = NULL;
+	size_t n = 0;
+
+	if (budget > sizeof(*hot))
+		n = (budget - sizeof(*hot)) / sizeof(hot->e[0]);
+	if (n >= CBTREE_HOT_PROBE) {
+		n = rounddown_pow_of_two(min_t(size_t, n, 1UL << 30));
+		hot = kvzalloc(struct_size(hot, e, n), GFP_KERNEL);
+		if (!hot)
+			return -ENOMEM;
+		hot->bits = ilog2(n);
+		hot->gen = 1;
+	}
+	kvfree(head->hot);
+	head->hot = hot;
+	return 0;
 }
-EXPORT_SYMBOL_GPL(cbtree_last);
+EXPORT_SYMBOL_GPL(cbtree_init_hot);
 
-static int keycmp(struct cbtree_geo *geo, unsigned long *node, int pos,
+static __always_inline int keycmp(struct cbtree_geo *geo, unsigned long *node, int pos,
 		  unsigned long *key)
 {
+#ifdef CBTREE_KEYCMP_STATS
+	this_cpu_inc(cbtree_keycmp_nr);
+#endif
+	if (geo->packed) {
+		unsigned long k = *bkey32(node, pos);
+
+		return k < key[0] ? -1 : k > key[0];
+	}
 	return longcmp(bkey(geo, node, pos), key, geo->keylen);
 }
 
-//binary search for cbtree, it just maked for to search one node's key
-
-static int keyzero(struct cbtree_geo *geo, unsigned long *key)
+/*
+ * Return the first slot whose key is smaller than or equal to @key.  Keys
+ * are sorted in descending order and unused slots hold zero keys, so
+ * "keycmp() <= 0" is false for a prefix of the node and true for the rest,
+ * including the empty tail.  The linear scan stops at the first match, the
+ * binary search looks for the same boundary in log2(no_pairs) compares.
+ */
+static __always_inline int getpos_linear(struct cbtree_geo *geo, unsigned long *node,
+		unsigned long *key)
 {
 	int i;
 
-	for (i = 0; i < geo->keylen; i++)
-		if (key[i])
-			return 0;
-
-	return 1;
+	for (i = 0; i < geo->no_pairs; i++) {
+		if (keycmp(geo, node, i, key) <= 0)
+			break;
+	}
+	return i;
 }
 
-static void *cbtree_lookup_node(struct cbtree_head *head, unsigned long * h_node, struct cbtree_geo *geo,
-		unsigned long *key, int height)
+static __always_inline int getpos_bsearch(struct cbtree_geo *geo, unsigned long *node,
+		unsigned long *key)
 {
-	int i;
-	unsigned long *node = h_node;
-	unsigned long *temp_n = NULL;
+	int lo = 0, hi = geo->no_pairs, mid;
 
-	if (height == 0){
-		// printk("end point 1");
-		return NULL;
-	}
-	
-	// printk("now level %d finding key %d",height, key[0]);
-
-	///changed code to recersive funtion
-	int j;
-	if(height <= 1){
-		for (i = 0; i < geo->no_pairs; i++)
-			if (keycmp(geo, node, i, key) == 0){
-				// printk("\n\n\n\n\nfind by using original search %d %d\n\n\n\n\n", key[0]);
-				// printk("end point 2");
-				return node;
-			}
-		// printk("end point 3");
-		return NULL;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (keycmp(geo, node, mid, key) <= 0)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
+	return lo;
+}
 
-	// printk("node's key value before findNode %p pinter %d key----------", ((CircularQueue*)node[geo->keylen * geo->no_pairs + geo->no_longs])->head,\
-	((CircularQueue*)node[geo->keylen * geo->no_pairs + geo->no_longs])->head->key[0]);
+static __always_inline int getpos(struct cbtree_geo *geo, unsigned long *node,
+		unsigned long *key)
+{
+	if (geo->no_pairs >= cbtree_bsearch_pairs)
+		return getpos_bsearch(geo, node, key);
+	return getpos_linear(geo, node, key);
+}
 
-	temp_n = findNode(&node[geo->keylen * geo->no_pairs + geo->no_longs], key, head, geo->keylen * geo->no_pairs + geo->no_longs);
-	
-	if(temp_n != NULL){
-		// printk("\n\n\n\n\n\nfind by using cache %d\n\n\n\n\n\n", key[0]);
-		// printk("end point 4");
-		return temp_n;
-	}
-	for (i = 0; i < geo->no_pairs; i++)
-		if (keycmp(geo, node, i, key) <= 0)
-			break;
-	// printk("i = %d no_pairs %d",i,geo->no_pairs);
-	if (i == geo->no_pairs)
-		return NULL;
-	// printk("end point 5");
+/*
+ * Return the slot holding @key in leaf @node, or -1.
+ */
+static __always_inline int leaf_find(struct cbtree_geo *geo, unsigned long *node,
+		unsigned long *key)
+{
+	int pos = getpos(geo, node, key);
+
+	if (pos < geo->no_pairs && keycmp(geo, node, pos, key) == 0)
+		return pos;
+	return -1;
+}
+
+static int keyzero(struct cbtree_geo *geo, unsigned long *key)
+{
+	int i;
 
-	temp_n = node;// to save this level node address
+	for (i = 0; i < geo->keylen; i++)
+		if (key[i])
+			return 0;
 
-	node = bval(geo, node, i);
-	// printk("node = %d",node);
-	// printk("node address %d",&node);
-	if (!node){
+	return 1;
+}
 
-		// printk("end point 6");
-		return NULL;
-	}
-		
-	/*
-	if(height <= 1){
-		for (i = 0; i < geo->no_pairs; i++)
-			if (keycmp(geo, node, i, key) == 0){
-				printk("node %d", node);
-				return node;
-			}
+/*
+ * Start loading the keys of @node and its cache slots.  Only the lines
+ * getpos() and findNode() need are fetched, the values are read once per
+ * level and are left to the demand miss on large nodes.
+ */
+static __always_inline void prefetch_node(struct cbtree_geo *geo,
+		unsigned long *node)
+{
+	prefetch_range(node, geo->no_longs * sizeof(long));
+	prefetchQueue(nodeCache(node, geo->nodesize));
+}
+
+/*
+ * Return the leaf that holds @key, or NULL.  Every inner node on the way
+ * down first probes its cache; a cached leaf is only trusted if it still
+ * holds the key, since splits and merges move keys between leaves.  On
+ * success the leaf is cached in the inner nodes passed above the hit, on
+ * one in cbtree_cache_fill lookups of the CPU.
+ */
+static __always_inline unsigned long *__cbtree_lookup_leaf(
+		struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key)
+{
+	int i, height, depth = 0;
+	int arr_len = CACHE_START(geo);
+	unsigned long *path[CBTREE_MAX_PATH];
+	unsigned long *node = head->node;
+	unsigned long *leaf;
+	bool pf = head->flags & CBTREE_PREFETCH;
+
+	if (head->height == 0)
 		return NULL;
-	}
-	*/
-	height -= 1;
-	// printk("level change %d\n",height);
-	node = cbtree_lookup_node(head, node, geo, key, height);
-	// printk("return to level %d key is %d-----------", height++, key[0]);
-	if(node != NULL){
-		setcache(node, head, temp_n, key, geo->keylen * geo->no_pairs + geo->no_longs, geo->keylen);
-		// printk("node's key value %d", ((CircularQueue*)node[geo->keylen * geo->no_pairs + geo->no_longs])->head->key[0]);
-	}
-	/*
-	for ( ; height > 1; height--) {
-		for(int j ; j < 4;j++ ){
-			temp_n = getNodeValue((CircularQueue*)node[CACHE_START], key, head);
+
+	for (height = head->height; height > 1; height--) {
+		if (pf) {
+			/* overlap the child's miss with the cache probe */
+			prefetchQueue(nodeCache(node, geo->nodesize));
+			i = getpos(geo, node, key);
+			if (i < geo->no_pairs && bval(geo, node, i))
+				prefetch_node(geo, bval(geo, node, i));
 		}
-		if(temp_n != NULL)
-			return temp_n;
-		for (i = 0; i < geo->no_pairs; i++)
-			if (keycmp(geo, node, i, key) <= 0)
-				break;
+		leaf = findNode(nodeCache(node, geo->nodesize), key, head,
+				arr_len, geo->keylen, height);
+		if (leaf && leaf_find(geo, leaf, key) >= 0)
+			goto found;
+
+		if (!pf)
+			i = getpos(geo, node, key);
 		if (i == geo->no_pairs)
 			return NULL;
-		setcache((CircularQueue*)node[CACHE_START], head, unsigned long * node, unsigned long * key, unsigned long * c_key, int arr_len, int key_len)
+		if (depth < CBTREE_MAX_PATH)
+			path[depth++] = node;
 		node = bval(geo, node, i);
 		if (!node)
 			return NULL;
 	}
- 	*/
-	// printk("end point 7");
-	return node;
+	if (leaf_find(geo, node, key) < 0)
+		return NULL;
+	leaf = node;
+found:
+	if (!depth || !cacheSample())
+		return leaf;
+	while (depth--)
+		setcache(leaf, head, nodeCache(path[depth], geo->nodesize),
+				key, arr_len, geo->keylen, head->height - depth);
+	return leaf;
 }
 
-void *cbtree_lookup(struct cbtree_head *head, struct cbtree_geo *geo,
-		unsigned long *key)
+static __always_inline unsigned int hot_hash(struct cbtree_hot *hot,
+		struct cbtree_geo *geo, unsigned long *key)
 {
+	unsigned long h = key[0];
 	int i;
-	unsigned long *node;
-	
-	node = head->node;
-	node = cbtree_lookup_node(head, node, geo, key, head->height);
-	if (!node){
-		return NULL;
-		// for (i = 0; i < geo->no_pairs; i++)
-		// 	printk("returned value : %d",bval(geo, node, i));
-		// printk("\n\n\n\n");
-	}
-	else return node;
-		/*
-	for (i = 0; i < geo->no_pairs; i++)
-		if (keycmp(geo, node, i, key) == 0){
-			printk("\n\nfind by original way : %d\n\n",key[0]);
-			return bval(geo, node, i);
+
+	for (i = 1; i < geo->keylen; i++)
+		h = hash_long(h, BITS_PER_LONG) ^ key[i];
+	return hash_long(h, hot->bits);
+}
+
+/*
+ * Return the value of @key from the hot-key table, or NULL when it has no
+ * valid entry.  An entry whose leaf no longer holds the key is dropped.
+ */
+static __always_inline void *hot_find(struct cbtree_hot *hot,
+		struct cbtree_geo *geo, unsigned long *key)
+{
+	unsigned int mask = (1U << hot->bits) - 1;
+	unsigned int idx = hot_hash(hot, geo, key);
+	struct cbtree_hot_entry *e;
+	int i, pos;
+
+	for (i = 0; i < CBTREE_HOT_PROBE; i++) {
+		e = &hot->e[(idx + i) & mask];
+		if (e->gen != hot->gen || longcmp(e->key, key, geo->keylen))
+			continue;
+		pos = e->slot;
+		if (keycmp(geo, e->leaf, pos, key)) {
+			pos = leaf_find(geo, e->leaf, key);
+			if (pos < 0) {
+				e->gen = 0;
+				return NULL;
+			}
+			e->slot = pos;
 		}
-	*/		
+		return bval(geo, e->leaf, pos);
+	}
 	return NULL;
 }
-EXPORT_SYMBOL_GPL(cbtree_lookup);
 
-int cbtree_update(struct cbtree_head *head, struct cbtree_geo *geo,
-		 unsigned long *key, void *val)
+/*
+ * Remember that @key sits in slot @pos of @leaf.  The first stale entry of
+ * the window is reused, a full window gives up its entries in turn.
+ */
+static void hot_store(struct cbtree_hot *hot, struct cbtree_geo *geo,
+		unsigned long *key, unsigned long *leaf, int pos)
 {
+	unsigned int mask = (1U << hot->bits) - 1;
+	unsigned int idx = hot_hash(hot, geo, key);
+	struct cbtree_hot_entry *e;
 	int i;
-	unsigned long *node;
 
-	node = cbtree_lookup_node(head,head->node, geo, key,head->height);
-	if (!node)
-		return -ENOENT;
+	for (i = 0; i < CBTREE_HOT_PROBE; i++) {
+		e = &hot->e[(idx + i) & mask];
+		if (e->gen != hot->gen)
+			break;
+	}
+	if (i == CBTREE_HOT_PROBE)
+		e = &hot->e[(idx + hot->hand++ % CBTREE_HOT_PROBE) & mask];
+	longcpy(e->key, key, geo->keylen);
+	e->leaf = leaf;
+	e->slot = pos;
+	e->gen = hot->gen;
+}
 
-	for (i = 0; i < geo->no_pairs; i++)
-		if (keycmp(geo, node, i, key) == 0) {
-			setval(geo, node, i, val);
-			return 0;
+/*
+ * Answer a lookup from the leaf of this CPU's finger or from a neighbour of
+ * it.  Leaves hold disjoint ranges in key order, so a key between the
+ * smallest and largest key of a leaf, or beyond the edge leaf of the tree,
+ * is in that leaf or nowhere.  Returns false when the tree has to be
+ * descended.
+ */
+static __always_inline bool finger_find(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *key, void **val)
+{
+	/* only a hint, a task that migrated may as well use another CPU's */
+	struct cbtree_finger *f = raw_cpu_ptr(head->finger);
+	unsigned long *leaf = f->leaf, *next;
+	int i, pos;
+
+	if (!leaf || f->gen != head->node_gen)
+		return false;
+
+	*val = NULL;
+	for (i = 0; i < 2; i++) {
+		pos = getpos(geo, leaf, key);
+		if (pos < geo->no_pairs && bval(geo, leaf, pos)) {
+			if (keycmp(geo, leaf, pos, key) == 0)
+				*val = bval(geo, leaf, pos);
+			if (pos > 0 || *val)
+				break;
+			/* above the largest key */
+			next = leaf_next(geo, leaf);
+		} else if (pos == 0) {
+			/* an empty leaf */
+			return false;
+		} else {
+			/* below the smallest key */
+			next = leaf_prev(geo, leaf);
 		}
-	return -ENOENT;
+		if (!next)
+			break;
+		/* one step to a neighbour serves sequential scans */
+		leaf = next;
+	}
+	if (i == 2)
+		return false;
+	f->leaf = leaf;
+	return true;
 }
-EXPORT_SYMBOL_GPL(cbtree_update);
 
 /*
- * Usually this function is quite similar to normal lookup.  But the key of
- * a parent node may be smaller than the smallest key of all its siblings.
- * In such a case we cannot just return NULL, as we have only proven that no
- * key smaller than __key, but larger than this parent key exists.
- * So we set __key to the parent key and retry.  We have to use the smallest
- * such parent key, which is the last parent key we encountered.
+ * Run @fn on a snapshot of the root of a CBTREE_RCU tree without a lock.
+ * @fn checks the version of every node it reads and returns false when
+ * one changed under it; a writer in its write_seq section changes nodes
+ * without their versions, so write_seq has to stay put as well.  Until
+ * both hold @fn is repeated on the restored @key.  The nodes themselves
+ * stay allocated until rcu_read_unlock().
  */
-void *cbtree_get_prev(struct cbtree_head *head, struct cbtree_geo *geo,
-		     unsigned long *__key)
+static void *cbtree_read(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key,
+		bool (*fn)(struct cbtree_geo *geo, unsigned long *node,
+			   int height, unsigned long *key, void **val))
 {
-	int i, height;
-	unsigned long *node, *oldnode;
-	unsigned long *retry_key = NULL, key[MAX_KEYLEN];
+	unsigned long save[MAX_KEYLEN];
+	unsigned long *node;
+	unsigned int seq;
+	int height;
+	void *val;
+	bool done;
 
-	if (keyzero(geo, __key))
-		return NULL;
+	longcpy(save, key, geo->keylen);
+	rcu_read_lock();
+	for (;;) {
+		seq = read_seqcount_begin(&head->write_seq);
+		node = smp_load_acquire(&head->node);
+		height = READ_ONCE(head->height);
+		/*
+		 * A root and a height from two write sections don't match,
+		 * and @fn would take entries of the last level for nodes.
+		 */
+		if (read_seqcount_retry(&head->write_seq, seq))
+			continue;
+		val = NULL;
+		done = !node || !height || fn(geo, node, height, key, &val);
+		if (done && !read_seqcount_retry(&head->write_seq, seq))
+			break;
+		longcpy(key, save, geo->keylen);
+	}
+	rcu_read_unlock();
+	return val;
+}
 
-	if (head->height == 0)
+static bool rcu_lookup(struct cbtree_geo *geo, unsigned long *node,
+		int height, unsigned long *key, void **val);
+
+static __always_inline void *__cbtree_lookup(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *key)
+{
+	struct cbtree_finger *f;
+	unsigned long *node;
+	void *val;
+	int pos;
+
+	if (unlikely(head->flags & CBTREE_RCU))
+		return cbtree_read(head, geo, key, rcu_lookup);
+	if (head->finger && finger_find(head, geo, key, &val))
+		return val;
+	if (head->hot && head->height) {
+		val = hot_find(head->hot, geo, key);
+		if (val)
+			return val;
+	}
+	node = __cbtree_lookup_leaf(head, geo, key);
+	if (!node)
 		return NULL;
-	longcpy(key, __key, geo->keylen);
-retry:
-	dec_key(geo, key);
+	pos = leaf_find(geo, node, key);
+	if (head->hot)
+		hot_store(head->hot, geo, key, node, pos);
+	if (head->finger) {
+		f = raw_cpu_ptr(head->finger);
+		f->leaf = node;
+		f->gen = head->node_gen;
+	}
+	return bval(geo, node, pos);
+}
 
-	node = head->node;
-	for (height = head->height ; height > 1; height--) {
-		for (i = 0; i < geo->no_pairs; i++)
-			if (keycmp(geo, node, i, key) <= 0)
-				break;
+void *cbtree_lookup(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key)
+{
+	return __cbtree_lookup(head, tree_geo(head, geo), key);
+}
+EXPORT_SYMBOL_GPL(cbtree_lookup);
+
+/*
+ * Plain descent without the per-node caches, searching each node either
+ * with the AVX2 kernel or with getpos().  The caller holds the FPU when
+ * @simd is set.
+ */
+static void *cbtree_lookup_nocache(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *key, bool simd)
+{
+	unsigned long *node = head->node;
+	int i, height;
+
+	for (height = head->height; height > 0; height--) {
+		if (simd)
+			i = cbtree_simd_getpos(node, geo->no_pairs, *key);
+		else
+			i = getpos(geo, node, key);
 		if (i == geo->no_pairs)
-			goto miss;
-		oldnode = node;
+			return NULL;
+		if (height == 1)
+			return keycmp(geo, node, i, key) ? NULL : bval(geo, node, i);
 		node = bval(geo, node, i);
 		if (!node)
-			goto miss;
-		retry_key = bkey(geo, oldnode, i);
+			return NULL;
 	}
+	return NULL;
+}
 
-	if (!node)
-		goto miss;
+size_t cbtree_lookup_simd(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *keys, void **vals, size_t n)
+{
+	size_t i, end, found = 0;
+	bool simd;
+
+	geo = tree_geo(head, geo);
+	simd = geo->keylen == 1 && !geo->packed && cbtree_simd_usable();
+	for (i = 0; i < n; i = end) {
+		end = min_t(size_t, n, i + CBTREE_SIMD_BATCH);
+		if (simd)
+			cbtree_simd_begin();
+		for (; i < end; i++) {
+			vals[i] = cbtree_lookup_nocache(head, geo,
+					&keys[i * geo->keylen], simd);
+			if (vals[i])
+				found++;
+		}
+		if (simd)
+			cbtree_simd_end();
+	}
+	return found;
+}
+EXPORT_SYMBOL_GPL(cbtree_lookup_simd);
 
-	for (i = 0; i < geo->no_pairs; i++) {
-		if (keycmp(geo, node, i, key) <= 0) {
-			if (bval(geo, node, i)) {
-				longcpy(__key, bkey(geo, node, i), geo->keylen);
-				return bval(geo, node, i);
-			} else
-				goto miss;
+/*
+ * Group prefetching: all descents of a group advance one level at a time,
+ * and the child chosen for each key is prefetched before the next key of
+ * the group is searched.  By the time the group comes back to a key its
+ * node has had the whole group's worth of work to arrive.  The tree is
+ * balanced, so every descent of a group reaches the leaves together.
+ */
+static size_t cbtree_lookup_group(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *keys, void **vals,
+		size_t n)
+{
+	unsigned long *nodes[CBTREE_BATCH_GROUP];
+	unsigned long *key;
+	size_t j, found = 0;
+	int i, height;
+
+	for (j = 0; j < n; j++)
+		nodes[j] = head->node;
+
+	for (height = head->height; height > 1; height--) {
+		for (j = 0; j < n; j++) {
+			if (!nodes[j])
+				continue;
+			i = getpos(geo, nodes[j], &keys[j * geo->keylen]);
+			if (i == geo->no_pairs) {
+				nodes[j] = NULL;
+				continue;
+			}
+			nodes[j] = bval(geo, nodes[j], i);
+			if (nodes[j])
+				prefetch_node(geo, nodes[j]);
 		}
 	}
-miss:
-	if (retry_key) {
-		longcpy(key, retry_key, geo->keylen);
-		retry_key = NULL;
-		goto retry;
+
+	for (j = 0; j < n; j++) {
+		vals[j] = NULL;
+		if (!nodes[j])
+			continue;
+		key = &keys[j * geo->keylen];
+		i = getpos(geo, nodes[j], key);
+		if (i < geo->no_pairs && !keycmp(geo, nodes[j], i, key)) {
+			vals[j] = bval(geo, nodes[j], i);
+			if (vals[j])
+				found++;
+		}
 	}
-	return NULL;
+	return found;
 }
-EXPORT_SYMBOL_GPL(cbtree_get_prev);
- 
-static int getpos(struct cbtree_geo *geo, unsigned long *node,
-		unsigned long *key)
+
+size_t cbtree_lookup_batch(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *keys, void **vals, size_t n)
+{
+	size_t i, len, found = 0;
+
+	if (head->height == 0) {
+		memset(vals, 0, n * sizeof(*vals));
+		return 0;
+	}
+
+	geo = tree_geo(head, geo);
+	for (i = 0; i < n; i += len) {
+		len = min_t(size_t, n - i, CBTREE_BATCH_GROUP);
+		found += cbtree_lookup_group(head, geo, &keys[i * geo->keylen],
+				&vals[i], len);
+	}
+	return found;
+}
+EXPORT_SYMBOL_GPL(cbtree_lookup_batch);
+
+static __always_inline int getfill(struct cbtree_geo *geo, unsigned long *node, int start)
 {
 	int i;
 
-	for (i = 0; i < geo->no_pairs; i++) {
-		if (keycmp(geo, node, i, key) <= 0)
+	for (i = start; i < geo->no_pairs; i++)
+		if (!bval(geo, node, i))
 			break;
-	}
 	return i;
 }
 
-static int getfill(struct cbtree_geo *geo, unsigned long *node, int start)
+/*
+ * locate the correct leaf node in the cbtree
+ */
+static __always_inline unsigned long *find_level(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, int level)
+{
+	unsigned long *node = head->node;
+	int i, height;
+
+	if (head->flags & CBTREE_PREFETCH)
+		prefetch_node(geo, node);
+	for (height = head->height; height > level; height--) {
+		i = getpos(geo, node, key);
+
+		if ((i == geo->no_pairs) || !bval(geo, node, i)) {
+			/* right-most key is too large, update it */
+			/* FIXME: If the right-most key on higher levels is
+			 * always zero, this wouldn't be necessary. */
+			i--;
+			setkey(geo, node, i, key);
+		}
+		BUG_ON(i < 0);
+		node = bval(geo, node, i);
+		if ((head->flags & CBTREE_PREFETCH) && height - 1 > level)
+			prefetch_node(geo, node);
+	}
+	BUG_ON(!node);
+	return node;
+}
+
+/*
+ * Find the leaf a search for @key ends in, and in it the first slot with a
+ * key <= @key, which is the fill of the leaf if there is none.  Unlike
+ * find_level() this does not fix up the inner keys: a key below all keys
+ * of an inner node leads to its last child.
+ */
+static unsigned long *__range_seek(struct cbtree_geo *geo,
+		unsigned long *node, int height, unsigned long *key, int *pos)
+{
+	int i;
+
+	for ( ; height > 1; height--) {
+		i = getpos(geo, node, key);
+		if (i == geo->no_pairs || !bval(geo, node, i))
+			i = getfill(geo, node, 0) - 1;
+		/* only a reader racing with a writer finds an empty node */
+		if (i < 0)
+			return NULL;
+		node = node_child(geo, node, i);
+		if (!node)
+			return NULL;
+	}
+	*pos = getpos(geo, node, key);
+	return node;
+}
+
+static unsigned long *range_seek(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *key, int *pos)
+{
+	return __range_seek(geo, head->node, head->height, key, pos);
+}
+
+/* the leaf with the largest (@smallest false) or smallest keys, or NULL */
+static unsigned long *edge_leaf(struct cbtree_geo *geo, unsigned long *node,
+		int height, bool smallest)
+{
+	int i;
+
+	for ( ; height > 1 && node; height--) {
+		i = smallest ? getfill(geo, node, 0) - 1 : 0;
+		node = i < 0 ? NULL : node_child(geo, node, i);
+	}
+	return node;
+}
+
+/*
+ * Return the current entry of @iter, or end the scan when it left the leaf
+ * chain or went past @iter->end in the direction given by @sign.
+ */
+static void *iter_entry(struct cbtree_iter *iter, unsigned long *key,
+		int sign)
+{
+	struct cbtree_geo *geo = iter->geo;
+
+	if (!iter->leaf)
+		return NULL;
+	getkey(geo, iter->leaf, iter->pos, key);
+	if (longcmp(key, iter->end, geo->keylen) * sign > 0) {
+		iter->leaf = NULL;
+		return NULL;
+	}
+	return bval(geo, iter->leaf, iter->pos);
+}
+
+/* move to the next larger key, which is the previous slot */
+static void iter_step_up(struct cbtree_iter *iter)
+{
+	struct cbtree_geo *geo = iter->geo;
+
+	while (--iter->pos < 0) {
+		iter->leaf = leaf_next(geo, iter->leaf);
+		if (!iter->leaf)
+			return;
+		iter->pos = getfill(geo, iter->leaf, 0);
+	}
+}
+
+static void iter_step_down(struct cbtree_iter *iter)
+{
+	struct cbtree_geo *geo = iter->geo;
+
+	iter->pos++;
+	while (iter->pos == geo->no_pairs || !bval(geo, iter->leaf, iter->pos)) {
+		iter->leaf = leaf_prev(geo, iter->leaf);
+		iter->pos = 0;
+		if (!iter->leaf)
+			return;
+	}
+}
+
+void *cbtree_iter_first(struct cbtree_head *head, struct cbtree_geo *geo,
+		struct cbtree_iter *iter, unsigned long *lo, unsigned long *hi,
+		unsigned long *key)
+{
+	geo = tree_geo(head, geo);
+	iter->geo = geo;
+	iter->leaf = NULL;
+	if (head->height == 0)
+		return NULL;
+
+	longcpy(iter->end, hi, geo->keylen);
+	iter->leaf = range_seek(head, geo, lo, &iter->pos);
+	if (iter->pos == geo->no_pairs || !bval(geo, iter->leaf, iter->pos) ||
+	    keycmp(geo, iter->leaf, iter->pos, lo) != 0)
+		iter_step_up(iter);
+	return iter_entry(iter, key, 1);
+}
+EXPORT_SYMBOL_GPL(cbtree_iter_first);
+
+void *cbtree_iter_next(struct cbtree_iter *iter, unsigned long *key)
+{
+	if (!iter->leaf)
+		return NULL;
+	iter_step_up(iter);
+	return iter_entry(iter, key, 1);
+}
+EXPORT_SYMBOL_GPL(cbtree_iter_next);
+
+void *cbtree_iter_last(struct cbtree_head *head, struct cbtree_geo *geo,
+		struct cbtree_iter *iter, unsigned long *lo, unsigned long *hi,
+		unsigned long *key)
+{
+	geo = tree_geo(head, geo);
+	iter->geo = geo;
+	iter->leaf = NULL;
+	if (head->height == 0)
+		return NULL;
+
+	longcpy(iter->end, lo, geo->keylen);
+	iter->leaf = range_seek(head, geo, hi, &iter->pos);
+	if (iter->pos == geo->no_pairs || !bval(geo, iter->leaf, iter->pos)) {
+		/* no key <= @hi in this leaf, step past its last entry */
+		iter->pos--;
+		iter_step_down(iter);
+	}
+	return iter_entry(iter, key, -1);
+}
+EXPORT_SYMBOL_GPL(cbtree_iter_last);
+
+void *cbtree_iter_prev(struct cbtree_iter *iter, unsigned long *key)
+{
+	if (!iter->leaf)
+		return NULL;
+	iter_step_down(iter);
+	return iter_entry(iter, key, -1);
+}
+EXPORT_SYMBOL_GPL(cbtree_iter_prev);
+
+/*
+ * The ordered walks remember the entry they returned last.  A following
+ * cbtree_get_next() or cbtree_get_prev() for that key steps to the
+ * neighbouring entry from there instead of descending from the root, as
+ * long as the tree has not changed in between.  Readers racing on the
+ * cursor can only make it miss: its leaf is live while @seq is unchanged
+ * and the entry is checked against the key before it is used.
+ */
+static void cursor_save(struct cbtree_head *head, struct cbtree_iter *iter)
+{
+	WRITE_ONCE(head->cursor, iter->leaf);
+	WRITE_ONCE(head->cursor_pos, iter->pos);
+	WRITE_ONCE(head->cursor_seq, head->seq);
+}
+
+static bool cursor_find(struct cbtree_head *head, struct cbtree_geo *geo,
+		struct cbtree_iter *iter, unsigned long *key)
+{
+	iter->leaf = READ_ONCE(head->cursor);
+	iter->pos = READ_ONCE(head->cursor_pos);
+	if (!iter->leaf || READ_ONCE(head->cursor_seq) != head->seq)
+		return false;
+	return iter->pos >= 0 && iter->pos < geo->no_pairs &&
+		bval(geo, iter->leaf, iter->pos) &&
+		keycmp(geo, iter->leaf, iter->pos, key) == 0;
+}
+
+/* the entry @iter points at and its key, NULL past the end */
+static void *iter_key(struct cbtree_iter *iter, unsigned long *key)
+{
+	if (!iter->leaf)
+		return NULL;
+	getkey(iter->geo, iter->leaf, iter->pos, key);
+	return bval(iter->geo, iter->leaf, iter->pos);
+}
+
+static void *cursor_entry(struct cbtree_head *head, struct cbtree_iter *iter,
+		unsigned long *key)
+{
+	if (!iter->leaf)
+		return NULL;
+	cursor_save(head, iter);
+	return iter_key(iter, key);
+}
+
+/* point @iter at the smallest (or largest) entry below @node */
+static bool edge_seek(struct cbtree_iter *iter, unsigned long *node,
+		int height, bool smallest)
+{
+	struct cbtree_geo *geo = iter->geo;
+
+	iter->leaf = edge_leaf(geo, node, height, smallest);
+	if (!iter->leaf)
+		return false;
+	iter->pos = smallest ? getfill(geo, iter->leaf, 0) - 1 : 0;
+	return iter->pos >= 0 && bval(geo, iter->leaf, iter->pos);
+}
+
+/* from the slot a seek for @key found, step to the entry below @key */
+static void seek_prev(struct cbtree_iter *iter, unsigned long *key)
+{
+	struct cbtree_geo *geo = iter->geo;
+
+	if (iter->pos == geo->no_pairs || !bval(geo, iter->leaf, iter->pos)) {
+		/* everything in this leaf is larger, continue below it */
+		iter->pos--;
+		iter_step_down(iter);
+	} else if (keycmp(geo, iter->leaf, iter->pos, key) == 0) {
+		iter_step_down(iter);
+	}
+}
+
+/*
+ * __range_seek() for lockless readers, or edge_leaf() when @key is NULL,
+ * with every node checked before its child is trusted.  Returns false
+ * when a node changed; otherwise @iter points at the leaf found, NULL if
+ * there is none, and @v holds the version of that leaf.
+ */
+static bool rcu_seek(struct cbtree_iter *iter, unsigned long *node,
+		int height, unsigned long *key, bool smallest, unsigned long *v)
+{
+	struct cbtree_geo *geo = iter->geo;
+	unsigned long *child, cv;
+	int i;
+
+	iter->leaf = NULL;
+	if (!node_read_lock(geo, node, v))
+		return false;
+	for ( ; height > 1; height--) {
+		i = key ? getpos(geo, node, key) : 0;
+		if (key ? i == geo->no_pairs || !bval(geo, node, i) : smallest)
+			i = getfill(geo, node, 0) - 1;
+		child = i < 0 ? NULL : node_child(geo, node, i);
+		if (child && !node_read_lock(geo, child, &cv))
+			return false;
+		if (!node_read_check(geo, node, *v))
+			return false;
+		if (!child)
+			return true;
+		node = child;
+		*v = cv;
+	}
+	iter->leaf = node;
+	if (key)
+		iter->pos = getpos(geo, node, key);
+	else
+		iter->pos = smallest ? getfill(geo, node, 0) - 1 : 0;
+	return true;
+}
+
+/*
+ * iter_step_up() or iter_step_down() for lockless readers: a leaf is
+ * checked before its link to the next one is followed.
+ */
+static bool rcu_step(struct cbtree_iter *iter, unsigned long *v, bool up)
+{
+	struct cbtree_geo *geo = iter->geo;
+	unsigned long *leaf, lv;
+
+	for (;;) {
+		if (up ? --iter->pos >= 0 :
+		    ++iter->pos < geo->no_pairs && bval(geo, iter->leaf, iter->pos))
+			return true;
+		leaf = up ? leaf_next(geo, iter->leaf) : leaf_prev(geo, iter->leaf);
+		if (leaf && !node_read_lock(geo, leaf, &lv))
+			return false;
+		if (!node_read_check(geo, iter->leaf, *v))
+			return false;
+		iter->leaf = leaf;
+		if (!leaf)
+			return true;
+		*v = lv;
+		iter->pos = up ? getfill(geo, leaf, 0) : -1;
+	}
+}
+
+/* iter_key() for lockless readers */
+static bool rcu_entry(struct cbtree_iter *iter, unsigned long v,
+		unsigned long *key, void **val)
+{
+	struct cbtree_geo *geo = iter->geo;
+
+	if (!iter->leaf || iter->pos < 0)
+		return true;
+	*val = bval(geo, iter->leaf, iter->pos);
+	if (*val)
+		getkey(geo, iter->leaf, iter->pos, key);
+	return node_read_check(geo, iter->leaf, v);
+}
+
+/* the lookup and the ordered walks of a CBTREE_RCU tree, see cbtree_read() */
+static bool rcu_lookup(struct cbtree_geo *geo, unsigned long *node,
+		int height, unsigned long *key, void **val)
+{
+	struct cbtree_iter iter = { .geo = geo };
+	unsigned long v;
+
+	if (!rcu_seek(&iter, node, height, key, false, &v))
+		return false;
+	if (!iter.leaf)
+		return true;
+	if (iter.pos < geo->no_pairs && keycmp(geo, iter.leaf, iter.pos, key) == 0)
+		*val = bval(geo, iter.leaf, iter.pos);
+	return node_read_check(geo, iter.leaf, v);
+}
+
+static bool rcu_first(struct cbtree_geo *geo, unsigned long *node,
+		int height, unsigned long *key, void **val)
+{
+	struct cbtree_iter iter = { .geo = geo };
+	unsigned long v;
+
+	return rcu_seek(&iter, node, height, NULL, true, &v) &&
+		rcu_entry(&iter, v, key, val);
+}
+
+static bool rcu_last(struct cbtree_geo *geo, unsigned long *node,
+		int height, unsigned long *key, void **val)
+{
+	struct cbtree_iter iter = { .geo = geo };
+	unsigned long v;
+
+	return rcu_seek(&iter, node, height, NULL, false, &v) &&
+		rcu_entry(&iter, v, key, val);
+}
+
+static bool rcu_next(struct cbtree_geo *geo, unsigned long *node,
+		int height, unsigned long *key, void **val)
+{
+	struct cbtree_iter iter = { .geo = geo };
+	unsigned long v;
+
+	if (!rcu_seek(&iter, node, height, key, false, &v))
+		return false;
+	if (iter.leaf && !rcu_step(&iter, &v, true))
+		return false;
+	return rcu_entry(&iter, v, key, val);
+}
+
+/* like seek_prev() */
+static bool rcu_prev(struct cbtree_geo *geo, unsigned long *node,
+		int height, unsigned long *key, void **val)
+{
+	struct cbtree_iter iter = { .geo = geo };
+	unsigned long v;
+
+	if (!rcu_seek(&iter, node, height, key, false, &v))
+		return false;
+	if (!iter.leaf)
+		return true;
+	if (iter.pos == geo->no_pairs || !bval(geo, iter.leaf, iter.pos)) {
+		iter.pos--;
+		if (!rcu_step(&iter, &v, false))
+			return false;
+	} else if (keycmp(geo, iter.leaf, iter.pos, key) == 0) {
+		if (!rcu_step(&iter, &v, false))
+			return false;
+	}
+	return rcu_entry(&iter, v, key, val);
+}
+
+/*
+ * The walks below are also used by writers inside their write section,
+ * where the RCU versions would wait for themselves.
+ */
+static void *__cbtree_first(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key)
+{
+	struct cbtree_iter iter = { .geo = geo };
+
+	if (head->height == 0 ||
+	    !edge_seek(&iter, head->node, head->height, true))
+		return NULL;
+	return cursor_entry(head, &iter, key);
+}
+
+void *cbtree_first(struct cbtree_head *head, struct cbtree_geo *geo,
+		 unsigned long *key)
+{
+	geo = tree_geo(head, geo);
+	if (head->flags & CBTREE_RCU)
+		return cbtree_read(head, geo, key, rcu_first);
+	return __cbtree_first(head, geo, key);
+}
+EXPORT_SYMBOL_GPL(cbtree_first);
+
+static void *__cbtree_last(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key)
+{
+	struct cbtree_iter iter = { .geo = geo };
+
+	if (head->height == 0 ||
+	    !edge_seek(&iter, head->node, head->height, false))
+		return NULL;
+	return cursor_entry(head, &iter, key);
+}
+
+void *cbtree_last(struct cbtree_head *head, struct cbtree_geo *geo,
+		 unsigned long *key)
+{
+	geo = tree_geo(head, geo);
+	if (head->flags & CBTREE_RCU)
+		return cbtree_read(head, geo, key, rcu_last);
+	return __cbtree_last(head, geo, key);
+}
+EXPORT_SYMBOL_GPL(cbtree_last);
+
+static void *__cbtree_get_next(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *key)
+{
+	struct cbtree_iter iter;
+
+	if (head->height == 0)
+		return NULL;
+	iter.geo = geo;
+	/* a seek lands on @key or the slot below it, one step up either way */
+	if (!cursor_find(head, geo, &iter, key))
+		iter.leaf = range_seek(head, geo, key, &iter.pos);
+	iter_step_up(&iter);
+	return cursor_entry(head, &iter, key);
+}
+
+void *cbtree_get_next(struct cbtree_head *head, struct cbtree_geo *geo,
+		     unsigned long *key)
+{
+	geo = tree_geo(head, geo);
+	if (head->flags & CBTREE_RCU)
+		return cbtree_read(head, geo, key, rcu_next);
+	return __cbtree_get_next(head, geo, key);
+}
+EXPORT_SYMBOL_GPL(cbtree_get_next);
+
+static void *__cbtree_get_prev(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *key)
+{
+	struct cbtree_iter iter;
+
+	if (head->height == 0)
+		return NULL;
+	iter.geo = geo;
+	if (cursor_find(head, geo, &iter, key)) {
+		iter_step_down(&iter);
+		return cursor_entry(head, &iter, key);
+	}
+
+	iter.leaf = range_seek(head, geo, key, &iter.pos);
+	seek_prev(&iter, key);
+	return cursor_entry(head, &iter, key);
+}
+
+void *cbtree_get_prev(struct cbtree_head *head, struct cbtree_geo *geo,
+		     unsigned long *key)
+{
+	if (keyzero(geo, key))
+		return NULL;
+
+	geo = tree_geo(head, geo);
+	if (head->flags & CBTREE_RCU)
+		return cbtree_read(head, geo, key, rcu_prev);
+	return __cbtree_get_prev(head, geo, key);
+}
+EXPORT_SYMBOL_GPL(cbtree_get_prev);
+
+static int cbtree_grow(struct cbtree_head *head, struct cbtree_geo *geo,
+		      gfp_t gfp)
+{
+	unsigned long *node;
+	int fill;
+
+	node = cbtree_node_alloc(head, geo, gfp);
+	if (!node)
+		return -ENOMEM;
+	if (head->node) {
+		fill = getfill(geo, head->node, 0);
+		movepair(geo, node, 0, head->node, fill - 1);
+		setval(geo, node, 0, head->node);
+	}
+	set_root(head, node, head->height + 1);
+	return 0;
+}
+
+static void cbtree_shrink(struct cbtree_head *head, struct cbtree_geo *geo)
+{
+	unsigned long *node;
+	int fill;
+
+	if (head->height <= 1)
+		return;
+
+	node = head->node;
+	fill = getfill(geo, node, 0);
+	BUG_ON(fill > 1);
+	set_root(head, bval(geo, node, 0), head->height - 1);
+	cbtree_free_node(head, geo, node);
+}
+
+/*
+ * Is @node the first (largest keys) or last node of @level?
+ */
+static bool cbtree_edge_node(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *node, int level, bool first)
+{
+	/* edge_leaf() copes with the nodes other writers are changing */
+	return edge_leaf(geo, head->node, head->height - level + 1,
+			!first) == node;
+}
+
+/*
+ * Number of entries a split of the full @node moves to the new node, which
+ * takes the largest keys.  Half, unless @pos is at the outer end of an edge
+ * node and the tree asks for uneven splits of appends.
+ */
+static int split_count(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *node, int level, int pos, int fill)
+{
+	int keep;
+
+	if (head->append_fill <= 50)
+		return fill / 2;
+
+	keep = clamp(fill * head->append_fill / 100, 1, fill - 1);
+	if (pos == 0 && cbtree_edge_node(head, geo, node, level, true))
+		return fill - keep;
+	/*
+	 * Descending appends split the last child, whose new sibling has the
+	 * larger keys and goes in just before it.
+	 */
+	if (pos >= fill - (level > 1) &&
+	    cbtree_edge_node(head, geo, node, level, false))
+		return keep;
+	return fill / 2;
+}
+
+/* shift and insert @key and @val at @pos of @node, which holds @fill */
+static __always_inline void insert_pair(struct cbtree_geo *geo,
+		unsigned long *node, int pos, int fill, unsigned long *key,
+		void *val)
+{
+	int i;
+
+	for (i = fill; i > pos; i--)
+		movepair(geo, node, i, node, i - 1);
+	setkey(geo, node, pos, key);
+	setval(geo, node, pos, val);
+}
+
+/* move the @split entries with the largest keys of the full @node to @new */
+static void split_pairs(struct cbtree_geo *geo, unsigned long *node,
+		unsigned long *new, int split, int level)
+{
+	int i, fill = geo->no_pairs;
+
+	for (i = 0; i < split; i++)
+		movepair(geo, new, i, node, i);
+	for (i = split; i < fill; i++)
+		movepair(geo, node, i - split, node, i);
+	for (i = fill - split; i < fill; i++)
+		clearpair(geo, node, i);
+	if (level == 1)
+		leaf_link_next(geo, node, new);
+}
+
+/* remove the entry at @pos of @node, which holds @fill, and shift */
+static __always_inline void remove_pair(struct cbtree_geo *geo,
+		unsigned long *node, int pos, int fill)
+{
+	int i;
+
+	for (i = pos; i < fill - 1; i++)
+		movepair(geo, node, i, node, i + 1);
+	clearpair(geo, node, fill - 1);
+}
+
+static int cbtree_insert_level(struct cbtree_head *head, struct cbtree_geo *geo,
+			      unsigned long *key, void *val, int level,
+			      gfp_t gfp)
+{
+	unsigned long *node;
+	int pos, fill, err;
+	//printk("2");
+	BUG_ON(!val);
+	if (head->height < level) {
+		err = cbtree_grow(head, geo, gfp);
+		if (err)
+			return err;
+	}
+	//printk("3");
+retry:
+	node = find_level(head, geo, key, level);
+	pos = getpos(geo, node, key);
+	fill = getfill(geo, node, pos);
+	/* two identical keys are not allowed */
+	BUG_ON(pos < fill && keycmp(geo, node, pos, key) == 0);
+	//printk("4");
+	if (fill == geo->no_pairs) {
+		/* need to split node */
+		unsigned long *new;
+		unsigned long split_key[MAX_KEYLEN];
+		int split = split_count(head, geo, node, level, pos, fill);
+
+		new = cbtree_node_alloc(head, geo, gfp);
+		if (!new)
+			return -ENOMEM;
+		getkey(geo, node, split - 1, split_key);
+		err = cbtree_insert_level(head, geo, split_key,
+				new, level + 1, gfp);
+		if (err) {
+			mempool_free(new, head->mempool);
+			return err;
+		}
+		split_pairs(geo, node, new, split, level);
+		goto retry;
+	}
+	BUG_ON(fill >= geo->no_pairs);
+	//printk("5");
+	insert_pair(geo, node, pos, fill, key, val);
+
+	return 0;
+}
+
+/*
+ * Insert into a leaf that has room without going through the recursive
+ * cbtree_insert_level(), which is only needed for splits.
+ */
+static __always_inline int __cbtree_insert(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *key, void *val,
+		gfp_t gfp)
+{
+	unsigned long *node;
+	int pos, fill;
+
+	BUG_ON(!val);
+	head->seq++;
+	if (head->height == 0)
+		return cbtree_insert_level(head, geo, key, val, 1, gfp);
+
+	node = find_level(head, geo, key, 1);
+	pos = getpos(geo, node, key);
+	fill = getfill(geo, node, pos);
+	if (fill == geo->no_pairs)
+		return cbtree_insert_level(head, geo, key, val, 1, gfp);
+	/* two identical keys are not allowed */
+	BUG_ON(pos < fill && keycmp(geo, node, pos, key) == 0);
+
+	insert_pair(geo, node, pos, fill, key, val);
+	return 0;
+}
+
+/*
+ * Split the full @node, read at version @v, into *@spare for a writer
+ * that locks single nodes.  @parent, read at @pv, takes the new node like
+ * in cbtree_insert_level().  The next leaf is locked too, as its link back
+ * to @node changes.  The insert starts over afterwards.
+ */
+static int olc_split(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *parent, unsigned long pv, unsigned long *node,
+		unsigned long v, int level, unsigned long *key,
+		unsigned long **spare)
+{
+	unsigned long split_key[MAX_KEYLEN];
+	unsigned long *new = *spare, *next = NULL;
+	unsigned long nv;
+	int split, pos;
+
+	/* a split of the root grows the tree */
+	if (!parent)
+		return OLC_EXCL;
+	if (!new)
+		return OLC_ALLOC;
+	if (!node_upgrade(geo, parent, pv))
+		return OLC_RESTART;
+	if (!node_upgrade(geo, node, v))
+		goto unlock_parent;
+	if (level == 1) {
+		next = leaf_next(geo, node);
+		/* no waiting with locks held, take it only if it is free */
+		nv = next ? READ_ONCE(*node_version(geo, next)) : 0;
+		if (next && ((nv & NODE_LOCKED) || !node_upgrade(geo, next, nv)))
+			goto unlock_node;
+	}
+
+	*spare = NULL;
+	*node_version(geo, new) = NODE_LOCKED;
+	split = split_count(head, geo, node, level, getpos(geo, node, key),
+			geo->no_pairs);
+	getkey(geo, node, split - 1, split_key);
+	pos = getpos(geo, parent, split_key);
+	insert_pair(geo, parent, pos, getfill(geo, parent, pos), split_key, new);
+	split_pairs(geo, node, new, split, level);
+
+	node_write_unlock(geo, new);
+	if (next)
+		node_write_unlock(geo, next);
+unlock_node:
+	node_write_unlock(geo, node);
+unlock_parent:
+	node_write_unlock(geo, parent);
+	return OLC_RESTART;
+}
+
+/*
+ * Insert for a writer that locks single nodes.  Full nodes are split on
+ * the way down, so the parent of a split always has room, and a key below
+ * all keys of an inner node lowers its last key like find_level() does.
+ * Both start the insert over.  Only the leaf taking @key is locked in the
+ * end.
+ */
+static int olc_insert(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, void *val, unsigned long **spare)
+{
+	unsigned long *parent = NULL, *node = head->node, *child;
+	unsigned long pv = 0, v, cv;
+	int height = head->height, pos, fill;
+
+	if (!height)
+		return OLC_EXCL;
+	if (!node_read_lock(geo, node, &v))
+		return OLC_RESTART;
+	for (;;) {
+		fill = getfill(geo, node, 0);
+		if (fill == geo->no_pairs)
+			return olc_split(head, geo, parent, pv, node, v, height,
+					key, spare);
+		if (height == 1)
+			break;
+		pos = getpos(geo, node, key);
+		if (pos == fill) {
+			if (!fill || !node_upgrade(geo, node, v))
+				return OLC_RESTART;
+			setkey(geo, node, fill - 1, key);
+			node_write_unlock(geo, node);
+			return OLC_RESTART;
+		}
+		child = node_child(geo, node, pos);
+		if (!child || !node_read_lock(geo, child, &cv) ||
+		    !node_read_check(geo, node, v))
+			return OLC_RESTART;
+		parent = node;
+		pv = v;
+		node = child;
+		v = cv;
+		height--;
+	}
+
+	pos = getpos(geo, node, key);
+	if (!node_upgrade(geo, node, v))
+		return OLC_RESTART;
+	/* two identical keys are not allowed */
+	BUG_ON(pos < fill && keycmp(geo, node, pos, key) == 0);
+	insert_pair(geo, node, pos, fill, key, val);
+	node_write_unlock(geo, node);
+	return OLC_DONE;
+}
+
+/* __cbtree_insert() on a CBTREE_RCU tree whose head->lock is held */
+static int insert_locked(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, void *val, gfp_t gfp)
+{
+	int err;
+
+	/* a split on every level and a new root */
+	err = cbtree_reserve(head, head->height + 1, gfp);
+	if (err)
+		return err;
+	cbtree_write_begin(head, 0);
+	err = __cbtree_insert(head, geo, key, val, cbtree_write_gfp(gfp));
+	cbtree_write_end(head);
+	return err;
+}
+
+int cbtree_insert(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, void *val, gfp_t gfp)
+{
+	unsigned long *spare = NULL;
+	int err;
+
+	geo = tree_geo(head, geo);
+	if (likely(!(head->flags & CBTREE_RCU)))
+		return __cbtree_insert(head, geo, key, val, gfp);
+
+	if (head->writers) {
+		BUG_ON(!val);
+		do {
+			olc_enter(head);
+			err = olc_insert(head, geo, key, val, &spare);
+			olc_exit(head);
+			if (err == OLC_ALLOC) {
+				spare = mempool_alloc(head->mempool, gfp);
+				if (!spare)
+					return -ENOMEM;
+				node_init(geo, spare);
+			}
+		} while (err == OLC_RESTART || err == OLC_ALLOC);
+		if (spare)
+			mempool_free(spare, head->mempool);
+		if (err == OLC_DONE)
+			return 0;
+	}
+
+	mutex_lock(&head->lock);
+	err = insert_locked(head, geo, key, val, gfp);
+	mutex_unlock(&head->lock);
+	return err;
+}
+EXPORT_SYMBOL_GPL(cbtree_insert);
+
+/* nodes with fewer entries are merged with or refilled from a neighbour */
+static inline int rebalance_fill(struct cbtree_head *head,
+		struct cbtree_geo *geo)
+{
+	if (head->flags & CBTREE_BORROW)
+		return geo->no_pairs * 2 / 3;
+	return geo->no_pairs / 2;
+}
+
+static void *cbtree_remove_level(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, int level);
+static void merge(struct cbtree_head *head, struct cbtree_geo *geo, int level,
+		unsigned long *left, int lfill,
+		unsigned long *right, int rfill,
+		unsigned long *parent, int lpos)
+{
+	int i;
+	unsigned long key[MAX_KEYLEN];
+
+	for (i = 0; i < rfill; i++) {
+		/* Move all keys to the left */
+		movepair(geo, left, lfill + i, right, i);
+	}
+	/* Exchange left and right child in parent */
+	setval(geo, parent, lpos, right);
+	setval(geo, parent, lpos + 1, left);
+	/* Remove left (formerly right) child from parent */
+	getkey(geo, parent, lpos, key);
+	cbtree_remove_level(head, geo, key, level + 1);
+	
+	if (level == 1)
+		leaf_unlink(geo, right);
+	cbtree_free_node(head, geo, right);
+}
+
+/*
+ * Move the @n smallest entries of @left, which sits at @lpos in @parent,
+ * to the front of its right neighbour @right.  The parent key of @left is
+ * raised to its new smallest key, so that searches for the moved keys end
+ * in @right.
+ */
+static void shift_right(struct cbtree_geo *geo, unsigned long *parent,
+		int lpos, unsigned long *left, int lfill,
+		unsigned long *right, int rfill, int n)
+{
+	unsigned long key[MAX_KEYLEN];
+	int i;
+
+	for (i = rfill - 1; i >= 0; i--)
+		movepair(geo, right, i + n, right, i);
+	for (i = 0; i < n; i++) {
+		movepair(geo, right, i, left, lfill - n + i);
+		clearpair(geo, left, lfill - n + i);
+	}
+	getkey(geo, left, lfill - n - 1, key);
+	setkey(geo, parent, lpos, key);
+}
+
+/*
+ * Move the @n largest entries of @right to the end of its left neighbour
+ * @left, which sits at @lpos in @parent.  The parent key of @left is
+ * lowered to the smallest key moved.
+ */
+static void shift_left(struct cbtree_geo *geo, unsigned long *parent,
+		int lpos, unsigned long *left, int lfill,
+		unsigned long *right, int rfill, int n)
+{
+	unsigned long key[MAX_KEYLEN];
+	int i;
+
+	for (i = 0; i < n; i++)
+		movepair(geo, left, lfill + i, right, i);
+	for (i = n; i < rfill; i++)
+		movepair(geo, right, i - n, right, i);
+	for (i = rfill - n; i < rfill; i++)
+		clearpair(geo, right, i);
+	getkey(geo, left, lfill + n - 1, key);
+	setkey(geo, parent, lpos, key);
+}
+
+/*
+ * CBTREE_BORROW part of rebalance(): @child at @i in @parent has @fill
+ * entries and cannot be merged with a single neighbour.  If both
+ * neighbours can take its entries, spread them and merge it away,
+ * otherwise move entries over from the fuller neighbour.
+ */
+static void borrow(struct cbtree_head *head, struct cbtree_geo *geo,
+		int level, unsigned long *parent, int i,
+		unsigned long *child, int fill,
+		unsigned long *left, int no_left,
+		unsigned long *right, int no_right)
+{
+	int n;
+
+	if (left && right && no_left + fill + no_right <= 2 * geo->no_pairs) {
+		/*
+		 * Three into two: top up @left from @child, then merge the
+		 * rest with @right.  @child keeps at least one entry so that
+		 * the parent keys of @left and @child stay distinct.
+		 */
+		n = (no_left + fill + no_right) / 2 - no_left;
+		n = clamp(n, fill + no_right - geo->no_pairs, fill - 1);
+		if (n > 0)
+			shift_left(geo, parent, i - 1, left, no_left,
+					child, fill, n);
+		merge(head, geo, level, child, fill - n, right, no_right,
+				parent, i);
+		return;
+	}
+	if (left && (!right || no_left >= no_right)) {
+		n = (no_left - fill) / 2;
+		if (n > 0)
+			shift_right(geo, parent, i - 1, left, no_left,
+					child, fill, n);
+	} else if (right) {
+		n = (no_right - fill) / 2;
+		if (n > 0)
+			shift_left(geo, parent, i, child, fill,
+					right, no_right, n);
+	}
+}
+
+static void rebalance(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, int level, unsigned long *child, int fill)
+{
+	unsigned long *parent, *left = NULL, *right = NULL;
+	int i, no_left = 0, no_right = 0;
+
+	if (fill == 0) {
+		/* Because we don't steal entries from a neighbour, this case
+		 * can happen.  Parent node contains a single child, this
+		 * node, so merging with a sibling never happens.
+		 */
+		cbtree_remove_level(head, geo, key, level + 1);
+		if (level == 1)
+			leaf_unlink(geo, child);
+		cbtree_free_node(head, geo, child);
+		return;
+	}
+
+	parent = find_level(head, geo, key, level + 1);
+	i = getpos(geo, parent, key);
+	BUG_ON(bval(geo, parent, i) != child);
+
+	if (i > 0) {
+		left = bval(geo, parent, i - 1);
+		no_left = getfill(geo, left, 0);
+		if (fill + no_left <= geo->no_pairs) {
+			merge(head, geo, level,
+					left, no_left,
+					child, fill,
+					parent, i - 1);
+			return;
+		}
+	}
+	if (i + 1 < getfill(geo, parent, i)) {
+		right = bval(geo, parent, i + 1);
+		no_right = getfill(geo, right, 0);
+		if (fill + no_right <= geo->no_pairs) {
+			merge(head, geo, level,
+					child, fill,
+					right, no_right,
+					parent, i);
+			return;
+		}
+	}
+	/*
+	 * Unless CBTREE_BORROW is set, we don't steal entries from the
+	 * left or right neighbor.  By not doing so we changed the
+	 * invariant from "all nodes are at least half full" to "no two
+	 * neighboring nodes can be merged".  Which means that the average
+	 * fill of all nodes is still half or better.
+	 */
+	if (head->flags & CBTREE_BORROW)
+		borrow(head, geo, level, parent, i, child, fill,
+				left, no_left, right, no_right);
+}
+
+static void *cbtree_remove_level(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, int level)
+{
+	unsigned long *node;
+	int pos, fill;
+	void *ret;
+
+	if (level > head->height) {
+		/* we recursed all the way up */
+		set_root(head, NULL, 0);
+		return NULL;
+	}
+
+	node = find_level(head, geo, key, level);
+	pos = getpos(geo, node, key);
+	fill = getfill(geo, node, pos);
+	if ((level == 1) && (keycmp(geo, node, pos, key) != 0))
+		return NULL;
+	ret = bval(geo, node, pos);
+	remove_pair(geo, node, pos, fill);
+
+	if (fill - 1 < rebalance_fill(head, geo)) {
+		if (level < head->height)
+			rebalance(head, geo, key, level, node, fill - 1);
+		else if (fill - 1 == 1)
+			cbtree_shrink(head, geo);
+	}
+
+	return ret;
+}
+
+/*
+ * Remove from a leaf that stays at least half full, or from a root leaf,
+ * without going through cbtree_remove_level(), which is only needed when
+ * the leaf has to be rebalanced.
+ */
+static __always_inline void *__cbtree_remove(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *key)
+{
+	unsigned long *node;
+	int pos, fill;
+	void *ret;
+
+	if (head->height == 0)
+		return NULL;
+
+	head->seq++;
+	node = find_level(head, geo, key, 1);
+	pos = getpos(geo, node, key);
+	fill = getfill(geo, node, pos);
+	if (pos == geo->no_pairs || keycmp(geo, node, pos, key) != 0)
+		return NULL;
+	if (fill - 1 < rebalance_fill(head, geo) && head->height > 1)
+		return cbtree_remove_level(head, geo, key, 1);
+
+	ret = bval(geo, node, pos);
+	remove_pair(geo, node, pos, fill);
+	return ret;
+}
+
+/*
+ * Find the slot of @key for a writer that locks single nodes, @iter->leaf
+ * is NULL if the tree does not hold @key.  @v is the version of the leaf.
+ */
+static int olc_find(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, struct cbtree_iter *iter, unsigned long *v)
+{
+	iter->geo = geo;
+	iter->leaf = NULL;
+	if (head->height == 0)
+		return OLC_DONE;
+	if (!rcu_seek(iter, head->node, head->height, key, false, v))
+		return OLC_RESTART;
+	if (!iter->leaf)
+		return OLC_EXCL;
+	if (iter->pos < geo->no_pairs && bval(geo, iter->leaf, iter->pos) &&
+	    keycmp(geo, iter->leaf, iter->pos, key) == 0)
+		return OLC_DONE;
+	if (!node_read_check(geo, iter->leaf, *v))
+		return OLC_RESTART;
+	iter->leaf = NULL;
+	return OLC_DONE;
+}
+
+/* __cbtree_remove() for a writer that locks single nodes */
+static int olc_remove(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, void **val)
+{
+	struct cbtree_iter iter;
+	unsigned long v;
+	int err, fill;
+
+	*val = NULL;
+	err = olc_find(head, geo, key, &iter, &v);
+	if (err || !iter.leaf)
+		return err;
+	fill = getfill(geo, iter.leaf, iter.pos);
+	if (fill - 1 < rebalance_fill(head, geo) && head->height > 1)
+		return OLC_EXCL;
+	if (!node_upgrade(geo, iter.leaf, v))
+		return OLC_RESTART;
+	*val = bval(geo, iter.leaf, iter.pos);
+	remove_pair(geo, iter.leaf, iter.pos, fill);
+	node_write_unlock(geo, iter.leaf);
+	return OLC_DONE;
+}
+
+/* __cbtree_remove() on a CBTREE_RCU tree whose head->lock is held */
+static void *remove_locked(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key)
+{
+	void *val;
+
+	cbtree_write_begin(head, 0);
+	val = __cbtree_remove(head, geo, key);
+	cbtree_write_end(head);
+	return val;
+}
+
+void *cbtree_remove(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key)
+{
+	void *val;
+	int err;
+
+	geo = tree_geo(head, geo);
+	if (likely(!(head->flags & CBTREE_RCU)))
+		return __cbtree_remove(head, geo, key);
+
+	if (head->writers) {
+		do {
+			olc_enter(head);
+			err = olc_remove(head, geo, key, &val);
+			olc_exit(head);
+		} while (err == OLC_RESTART);
+		if (err == OLC_DONE)
+			return val;
+	}
+
+	mutex_lock(&head->lock);
+	val = remove_locked(head, geo, key);
+	mutex_unlock(&head->lock);
+	return val;
+}
+EXPORT_SYMBOL_GPL(cbtree_remove);
+
+static int __cbtree_update(struct cbtree_head *head, struct cbtree_geo *geo,
+		 unsigned long *key, void *val)
+{
+	unsigned long *node;
+
+	node = __cbtree_lookup_leaf(head, geo, key);
+	if (!node)
+		return -ENOENT;
+
+	setval(geo, node, leaf_find(geo, node, key), val);
+	return 0;
+}
+
+/* __cbtree_update() for a writer that locks single nodes */
+static int olc_update(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, void *val, int *ret)
+{
+	struct cbtree_iter iter;
+	unsigned long v;
+	int err;
+
+	*ret = -ENOENT;
+	err = olc_find(head, geo, key, &iter, &v);
+	if (err || !iter.leaf)
+		return err;
+	if (!node_upgrade(geo, iter.leaf, v))
+		return OLC_RESTART;
+	setval(geo, iter.leaf, iter.pos, val);
+	node_write_unlock(geo, iter.leaf);
+	*ret = 0;
+	return OLC_DONE;
+}
+
+int cbtree_update(struct cbtree_head *head, struct cbtree_geo *geo,
+		 unsigned long *key, void *val)
+{
+	int err, ret;
+
+	geo = tree_geo(head, geo);
+	if (likely(!(head->flags & CBTREE_RCU)))
+		return __cbtree_update(head, geo, key, val);
+
+	if (head->writers) {
+		do {
+			olc_enter(head);
+			err = olc_update(head, geo, key, val, &ret);
+			olc_exit(head);
+		} while (err == OLC_RESTART);
+		if (err == OLC_DONE)
+			return ret;
+	}
+
+	mutex_lock(&head->lock);
+	cbtree_write_begin(head, 0);
+	err = __cbtree_update(head, geo, key, val);
+	cbtree_write_end(head);
+	mutex_unlock(&head->lock);
+	return err;
+}
+EXPORT_SYMBOL_GPL(cbtree_update);
+
+/*
+ * State of one cbtree_remove_range() pass.
+ */
+struct range_op {
+	unsigned long *lo, *hi;
+	unsigned long opaque;
+	void (*func)(void *elem, unsigned long opaque, unsigned long *key,
+		     size_t index, void *func2);
+	void *func2;
+	size_t count;
+};
+
+static void range_report(struct cbtree_geo *geo, struct range_op *op,
+		unsigned long *leaf, int pos)
+{
+	unsigned long key[MAX_KEYLEN];
+
+	if (!op->func)
+		return;
+	getkey(geo, leaf, pos, key);
+	op->func(bval(geo, leaf, pos), op->opaque, key, op->count, op->func2);
+}
+
+/* Report every entry below @node and free the whole subtree. */
+static void range_drop(struct cbtree_head *head, struct cbtree_geo *geo,
+		struct range_op *op, unsigned long *node, int height)
+{
+	int i;
+
+	for (i = 0; i < geo->no_pairs && bval(geo, node, i); i++) {
+		if (height > 1) {
+			range_drop(head, geo, op, bval(geo, node, i), height - 1);
+		} else {
+			range_report(geo, op, node, i);
+			op->count++;
+		}
+	}
+	if (height == 1)
+		leaf_unlink(geo, node);
+	cbtree_free_node(head, geo, node);
+}
+
+/*
+ * Remove the part of [lo, hi] that lies below @node, whose keys are all
+ * smaller than @upper (%NULL: no bound).  Children entirely inside the
+ * range are dropped without looking at their keys again, children
+ * entirely outside are skipped, only the ones straddling lo or hi are
+ * descended into.  Children left empty are freed.  Returns the new fill.
+ */
+static int range_remove_node(struct cbtree_head *head, struct cbtree_geo *geo,
+		struct range_op *op, unsigned long *node, int height,
+		unsigned long *upper)
+{
+	unsigned long key[MAX_KEYLEN], prev[MAX_KEYLEN];
+	unsigned long *bound = upper, *child;
+	int i, w = 0, fill = getfill(geo, node, 0);
+
+	for (i = 0; i < fill; i++) {
+		getkey(geo, node, i, key);
+		child = bval(geo, node, i);
+
+		if (height == 1) {
+			if (longcmp(key, op->lo, geo->keylen) >= 0 &&
+			    longcmp(key, op->hi, geo->keylen) <= 0) {
+				range_report(geo, op, node, i);
+				op->count++;
+				continue;
+			}
+		} else if (longcmp(key, op->hi, geo->keylen) > 0 ||
+			   (bound && longcmp(bound, op->lo, geo->keylen) <= 0)) {
+			/* entirely above hi or below lo */
+		} else if (longcmp(key, op->lo, geo->keylen) >= 0 && bound &&
+			   longcmp(bound, op->hi, geo->keylen) <= 0) {
+			range_drop(head, geo, op, child, height - 1);
+			goto next;
+		} else if (!range_remove_node(head, geo, op, child, height - 1,
+					      bound)) {
+			if (height == 2)
+				leaf_unlink(geo, child);
+			cbtree_free_node(head, geo, child);
+			goto next;
+		}
+		movepair(geo, node, w++, node, i);
+next:
+		longcpy(prev, key, geo->keylen);
+		bound = prev;
+	}
+	for (i = w; i < fill; i++)
+		clearpair(geo, node, i);
+	return w;
+}
+
+/* merge the nodes around @key with their neighbours where they fit */
+static void range_fixup(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key)
+{
+	unsigned long *node;
+	int level, fill;
+
+	for (level = 1; level < head->height; level++) {
+		node = find_level(head, geo, key, level);
+		fill = getfill(geo, node, 0);
+		if (fill < rebalance_fill(head, geo))
+			rebalance(head, geo, key, level, node, fill);
+	}
+}
+
+static size_t __cbtree_remove_range(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *lo, unsigned long *hi,
+		unsigned long opaque,
+		void (*func)(void *elem, unsigned long opaque,
+			     unsigned long *key, size_t index, void *func2),
+		void *func2)
+{
+	struct range_op op = {
+		.lo = lo, .hi = hi, .opaque = opaque,
+		.func = func, .func2 = func2,
+	};
+	unsigned long below[MAX_KEYLEN], above[MAX_KEYLEN];
+	bool has_below, has_above;
+
+	if (head->height == 0)
+		return 0;
+	if (longcmp(lo, hi, geo->keylen) > 0)
+		return 0;
+
+	head->seq++;
+	if (!range_remove_node(head, geo, &op, head->node, head->height, NULL)) {
+		if (head->height == 1)
+			leaf_unlink(geo, head->node);
+		cbtree_free_node(head, geo, head->node);
+		set_root(head, NULL, 0);
+		return op.count;
+	}
+	if (!op.count)
+		return 0;
+
+	/* only the paths to the entries next to the hole can be underfull */
+	longcpy(below, lo, geo->keylen);
+	has_below = !keyzero(geo, below) &&
+		    __cbtree_get_prev(head, geo, below) != NULL;
+	longcpy(above, hi, geo->keylen);
+	has_above = __cbtree_get_next(head, geo, above) != NULL;
+	if (has_below)
+		range_fixup(head, geo, below);
+	if (has_above)
+		range_fixup(head, geo, above);
+	while (head->height > 1 && getfill(geo, head->node, 0) == 1)
+		cbtree_shrink(head, geo);
+	head->seq++;
+	return op.count;
+}
+
+/*
+ * Entries a CBTREE_RCU tree loses per write section of
+ * cbtree_remove_range().  Their keys are kept on the stack for @func.
+ */
+#define CBTREE_RANGE_BATCH	16
+
+size_t cbtree_remove_range(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *lo, unsigned long *hi, unsigned long opaque,
+		void (*func)(void *elem, unsigned long opaque,
+			     unsigned long *key, size_t index, void *func2),
+		void *func2)
+{
+	unsigned long keys[CBTREE_RANGE_BATCH][MAX_KEYLEN];
+	void *elems[CBTREE_RANGE_BATCH];
+	unsigned long from[MAX_KEYLEN];
+	struct cbtree_iter iter;
+	size_t count = 0;
+	int i, nr;
+
+	geo = tree_geo(head, geo);
+	if (likely(!(head->flags & CBTREE_RCU)))
+		return __cbtree_remove_range(head, geo, lo, hi, opaque, func,
+				func2);
+
+	/*
+	 * Collect a batch with the other writers stopped, cut it out in a
+	 * short write section and report it afterwards.  The last key of
+	 * a batch is gone, so the next batch starts after it.
+	 */
+	mutex_lock(&head->lock);
+	cbtree_writers_stop(head);
+	longcpy(from, lo, geo->keylen);
+	do {
+		nr = 0;
+		elems[0] = cbtree_iter_first(head, geo, &iter, from, hi,
+				keys[0]);
+		while (elems[nr] && ++nr < CBTREE_RANGE_BATCH)
+			elems[nr] = cbtree_iter_next(&iter, keys[nr]);
+		if (!nr)
+			break;
+		longcpy(from, keys[nr - 1], geo->keylen);
+		cbtree_write_begin(head, 0);
+		__cbtree_remove_range(head, geo, keys[0], from, 0, NULL, NULL);
+		cbtree_write_end(head);
+		for (i = 0; func && i < nr; i++)
+			func(elems[i], opaque, keys[i], count + i, func2);
+		count += nr;
+	} while (nr == CBTREE_RANGE_BATCH);
+	cbtree_writers_start(head);
+	mutex_unlock(&head->lock);
+	return count;
+}
+EXPORT_SYMBOL_GPL(cbtree_remove_range);
+
+/*
+ * Node allocation for bulk_build().  Trees whose mempool is backed
+ * by cbtree_alloc() take their nodes from the slab CBTREE_BULK_BATCH at a
+ * time, other mempools are used one node at a time.
+ */
+#define CBTREE_BULK_BATCH	32
+
+struct bulk_alloc {
+	struct kmem_cache *cachep;
+	void *objs[CBTREE_BULK_BATCH];
+	int nr;
+	gfp_t gfp;
+};
+
+static unsigned long *bulk_node_alloc(struct cbtree_head *head,
+		struct cbtree_geo *geo, struct bulk_alloc *ba)
+{
+	unsigned long *node;
+
+	if (!ba->cachep)
+		return cbtree_node_alloc(head, geo, ba->gfp);
+
+	if (!ba->nr) {
+		ba->nr = kmem_cache_alloc_bulk(ba->cachep, ba->gfp,
+				CBTREE_BULK_BATCH, ba->objs);
+		if (!ba->nr)
+			return NULL;
+	}
+	node = ba->objs[--ba->nr];
+	memset(node, 0, geo->nodesize);
+	initQueue(nodeCache(node, geo->nodesize));
+	smp_wmb();
+	return node;
+}
+
+static void bulk_free(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *node, int height)
+{
+	int i;
+
+	if (height > 1)
+		for (i = 0; i < geo->no_pairs && bval(geo, node, i); i++)
+			bulk_free(head, geo, bval(geo, node, i), height - 1);
+	mempool_free(node, head->mempool);
+}
+
+/*
+ * One level of the tree under construction: @nodes nodes share @count
+ * entries as evenly as possible, node @idx is the one being filled.
+ */
+struct bulk_level {
+	unsigned long *node;
+	size_t count, nodes, idx;
+	int fill, target;
+};
+
+static void bulk_next_target(struct bulk_level *lv)
+{
+	lv->target = lv->count / lv->nodes + (lv->idx < lv->count % lv->nodes);
+}
+
+/*
+ * Entries for bulk_build(), largest key first.  ->next() points @key at
+ * the next key and returns its value.
+ */
+struct bulk_src {
+	void *(*next)(struct bulk_src *src, unsigned long **key);
+};
+
+/*
+ * Build a tree of exactly @n entries from @src with nodes of @head, and
+ * return its root and height in @root and @root_height.  @head itself is
+ * not touched, the caller puts the new tree in place.  Returns 0 or a
+ * negative errno, in which case the entries taken from @src are lost.
+ */
+static int bulk_build(struct cbtree_head *head, struct cbtree_geo *geo,
+		struct bulk_src *src, size_t n, int fill_factor, gfp_t gfp,
+		unsigned long **root, int *root_height)
+{
+	struct bulk_level levels[CBTREE_MAX_PATH];
+	struct bulk_alloc ba = { .nr = 0, .gfp = gfp };
+	unsigned long *key, *last_leaf = NULL;
+	void *val;
+	size_t i, count;
+	int l, height, per;
+
+	/* inner nodes need two children, or the levels would never end */
+	per = max(2, geo->no_pairs * fill_factor / 100);
+	count = n;
+	for (height = 0; ; height++) {
+		if (height == CBTREE_MAX_PATH)
+			return -E2BIG;
+		levels[height].node = NULL;
+		levels[height].count = count;
+		levels[height].nodes = DIV_ROUND_UP(count, per);
+		levels[height].idx = 0;
+		count = levels[height].nodes;
+		if (count == 1)
+			break;
+	}
+	height++;
+
+	if (head->mempool->alloc == cbtree_alloc)
+		ba.cachep = head->mempool->pool_data ?: cbtree_cachep;
+
+	/*
+	 * Nodes are sorted in descending order, so feed the keys from the
+	 * largest one.  A node is complete when it reaches its share of the
+	 * level; its last key is its smallest and becomes the key of the
+	 * node in the parent, which is the same key that was just stored.
+	 */
+	for (i = 0; i < n; i++) {
+		val = src->next(src, &key);
+		for (l = 0; l < height; l++) {
+			struct bulk_level *lv = &levels[l];
+
+			if (!lv->node) {
+				lv->node = bulk_node_alloc(head, geo, &ba);
+				if (!lv->node)
+					goto nomem;
+				lv->fill = 0;
+				bulk_next_target(lv);
+				if (l == 0) {
+					leaf_set_prev(geo, last_leaf, lv->node);
+					leaf_set_next(geo, lv->node, last_leaf);
+					last_leaf = lv->node;
+				}
+			}
+			setkey(geo, lv->node, lv->fill, key);
+			setval(geo, lv->node, lv->fill, val);
+			if (++lv->fill < lv->target)
+				break;
+
+			val = lv->node;
+			lv->node = NULL;
+			lv->idx++;
+		}
+	}
+
+	*root = val;
+	*root_height = height;
+	if (ba.nr)
+		kmem_cache_free_bulk(ba.cachep, ba.nr, ba.objs);
+	return 0;
+
+nomem:
+	for (l = 0; l < height; l++)
+		if (levels[l].node)
+			bulk_free(head, geo, levels[l].node, l + 1);
+	if (ba.nr)
+		kmem_cache_free_bulk(ba.cachep, ba.nr, ba.objs);
+	return -ENOMEM;
+}
+
+struct bulk_array {
+	struct bulk_src src;
+	unsigned long *keys;
+	void **vals;
+	size_t i;
+	int keylen;
+};
+
+static void *bulk_array_next(struct bulk_src *src, unsigned long **key)
+{
+	struct bulk_array *a = container_of(src, struct bulk_array, src);
+
+	a->i--;
+	*key = &a->keys[a->i * a->keylen];
+	return a->vals[a->i];
+}
+
+int cbtree_bulk_load(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *keys, void **vals, size_t n, int fill_factor)
+{
+	struct bulk_array a = {
+		.src.next = bulk_array_next,
+		.keys = keys, .vals = vals, .i = n,
+	};
+	bool rcu = head->flags & CBTREE_RCU;
+	unsigned long *node;
+	size_t i;
+	int err, height;
+
+	if (head->height)
+		return -EEXIST;
+	if (fill_factor < 1 || fill_factor > 100)
+		return -EINVAL;
+	if (!n)
+		return 0;
+
+	geo = tree_geo(head, geo);
+	for (i = 0; i < n; i++) {
+		if (!vals[i])
+			return -EINVAL;
+		if (i && longcmp(&keys[(i - 1) * geo->keylen],
+				 &keys[i * geo->keylen], geo->keylen) >= 0)
+			return -EINVAL;
+	}
+	a.keylen = geo->keylen;
+	if (rcu) {
+		mutex_lock(&head->lock);
+		err = -EEXIST;
+		if (head->height)
+			goto unlock;
+		/* the readers see the empty tree until the new one is done */
+		cbtree_writers_stop(head);
+	}
+	err = bulk_build(head, geo, &a.src, n, fill_factor, GFP_KERNEL,
+			&node, &height);
+	if (!err) {
+		if (rcu)
+			cbtree_write_begin(head, 0);
+		set_root(head, node, height);
+		head->seq++;
+		if (rcu)
+			cbtree_write_end(head);
+	}
+	if (!rcu)
+		return err;
+	cbtree_writers_start(head);
+unlock:
+	mutex_unlock(&head->lock);
+	return err;
+}
+EXPORT_SYMBOL_GPL(cbtree_bulk_load);
+
+/*
+ * Lookup, insert and remove for one of the built-in geometries.  The
+ * geometry is a compile-time constant here, so keylen, no_pairs and
+ * no_longs fold into the inlined helpers above: the longcmp()/longcpy()
+ * loops disappear for single-long keys and the node scans get a constant
+ * trip count.  The typed wrappers in cbtree-type.h and cbtree-128.h call
+ * these instead of the generic functions.  Trees with their own node size
+ * take the generic path, and so do the writers of CBTREE_RCU trees.
+ */
+#define CBTREE_DEFINE_SPEC(name, init)					\
+static const struct cbtree_geo name##_spec = init;			\
+									\
+void *cbtree_lookup_##name(struct cbtree_head *head, unsigned long *key) \
+{									\
+	if (unlikely(head->cachep))					\
+		return cbtree_lookup(head, &head->geo, key);		\
+	return __cbtree_lookup(head, (struct cbtree_geo *)&name##_spec, key); \
+}									\
+EXPORT_SYMBOL_GPL(cbtree_lookup_##name);				\
+									\
+int cbtree_insert_##name(struct cbtree_head *head, unsigned long *key,	\
+			 void *val, gfp_t gfp)				\
+{									\
+	if (unlikely(head->cachep || (head->flags & CBTREE_RCU)))	\
+		return cbtree_insert(head, (struct cbtree_geo *)&name##_spec, \
+				     key, val, gfp);			\
+	return __cbtree_insert(head, (struct cbtree_geo *)&name##_spec,	\
+			       key, val, gfp);				\
+}									\
+EXPORT_SYMBOL_GPL(cbtree_insert_##name);				\
+									\
+void *cbtree_remove_##name(struct cbtree_head *head, unsigned long *key) \
+{									\
+	if (unlikely(head->cachep || (head->flags & CBTREE_RCU)))	\
+		return cbtree_remove(head, (struct cbtree_geo *)&name##_spec, \
+				     key);				\
+	return __cbtree_remove(head, (struct cbtree_geo *)&name##_spec, key); \
+}									\
+EXPORT_SYMBOL_GPL(cbtree_remove_##name)
+
+CBTREE_DEFINE_SPEC(geo32, CBTREE_GEO_INIT(1, NODESIZE));
+CBTREE_DEFINE_SPEC(geo32p, CBTREE_GEO_PACKED_INIT(NODESIZE));
+CBTREE_DEFINE_SPEC(geo64, CBTREE_GEO_INIT(LONG_PER_U64, NODESIZE));
+CBTREE_DEFINE_SPEC(geo128, CBTREE_GEO_INIT(2 * LONG_PER_U64, NODESIZE));
+
+/*
+ * cbtree_merge() reads both trees along their leaf chains, largest key
+ * first, and either inserts the victim's entries into the target or feeds
+ * the union of both to bulk_build().  Trees whose keys don't interleave
+ * are joined by grafting instead.
+ */
+#define CBTREE_MERGE_FILL	90
+
+struct merge_side {
+	struct cbtree_geo *geo;
+	unsigned long *leaf;
+	int pos;
+	unsigned long key[MAX_KEYLEN];
+};
+
+struct bulk_merge {
+	struct bulk_src src;
+	struct merge_side side[2];
+	unsigned long key[MAX_KEYLEN];
+};
+
+/* skip to the next entry in descending order and load its key */
+static void merge_side_load(struct merge_side *ms)
+{
+	while (ms->leaf && (ms->pos == ms->geo->no_pairs ||
+			    !bval(ms->geo, ms->leaf, ms->pos))) {
+		ms->leaf = leaf_prev(ms->geo, ms->leaf);
+		ms->pos = 0;
+	}
+	if (ms->leaf)
+		getkey(ms->geo, ms->leaf, ms->pos, ms->key);
+}
+
+static void merge_side_init(struct merge_side *ms, struct cbtree_head *head,
+		struct cbtree_geo *geo)
+{
+	ms->geo = geo;
+	ms->leaf = head->node ?
+		edge_leaf(geo, head->node, head->height, false) : NULL;
+	ms->pos = 0;
+	merge_side_load(ms);
+}
+
+static void *merge_side_next(struct merge_side *ms)
+{
+	void *val = bval(ms->geo, ms->leaf, ms->pos);
+
+	ms->pos++;
+	merge_side_load(ms);
+	return val;
+}
+
+static void *bulk_merge_next(struct bulk_src *src, unsigned long **key)
+{
+	struct bulk_merge *m = container_of(src, struct bulk_merge, src);
+	struct merge_side *ms = &m->side[0];
+	int cmp;
+
+	if (!m->side[0].leaf) {
+		ms = &m->side[1];
+	} else if (m->side[1].leaf) {
+		cmp = longcmp(m->side[0].key, m->side[1].key, ms->geo->keylen);
+		BUG_ON(cmp == 0);
+		if (cmp < 0)
+			ms = &m->side[1];
+	}
+	longcpy(m->key, ms->key, ms->geo->keylen);
+	*key = m->key;
+	return merge_side_next(ms);
+}
+
+static size_t merge_count(struct merge_side *ms)
+{
+	unsigned long *leaf;
+	size_t n = 0;
+
+	for (leaf = ms->leaf; leaf; leaf = leaf_prev(ms->geo, leaf))
+		n += getfill(ms->geo, leaf, 0);
+	return n;
+}
+
+/* lower estimate of the entries in @head, from its root and height */
+static size_t merge_estimate(struct cbtree_head *head, struct cbtree_geo *geo)
+{
+	size_t n = getfill(geo, head->node, 0);
+	int height;
+
+	for (height = head->height; height > 1; height--)
+		n *= max(2, geo->no_pairs / 2);
+	return n;
+}
+
+/* whether nodes of @a can move to @b and be freed there */
+static bool same_nodes(struct cbtree_head *a, struct cbtree_head *b)
+{
+	if (a->cachep || b->cachep)
+		return a->cachep == b->cachep;
+	if (a->mempool->alloc == cbtree_alloc &&
+	    b->mempool->alloc == cbtree_alloc)
+		return (a->mempool->pool_data ?: cbtree_cachep) ==
+		       (b->mempool->pool_data ?: cbtree_cachep);
+	return a->mempool == b->mempool;
+}
+
+/* free all nodes below @node, the entries are owned by another tree now */
+static void merge_free(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *node, int height)
 {
 	int i;
 
-	for (i = start; i < geo->no_pairs; i++)
-		if (!bval(geo, node, i))
-			break;
-	return i;
+	if (height > 1)
+		for (i = 0; i < geo->no_pairs && bval(geo, node, i); i++)
+			merge_free(head, geo, bval(geo, node, i), height - 1);
+	cbtree_free_node(head, geo, node);
 }
 
 /*
- * locate the correct leaf node in the cbtree
+ * All keys of @victim are below (@victim_low) or above those of @target.
+ * Hang the root of the shorter tree into the edge of the other one at the
+ * level it fits in, and link the leaves across the seam.  Only the nodes
+ * along that edge are touched.
  */
-static unsigned long *find_level(struct cbtree_head *head, struct cbtree_geo *geo,
-		unsigned long *key, int level)
+static int merge_graft(struct cbtree_head *target, struct cbtree_head *victim,
+		struct cbtree_geo *geo, bool victim_low, gfp_t gfp)
 {
-	unsigned long *node = head->node;
-	int i, height;
+	struct cbtree_head *lo = victim_low ? victim : target;
+	struct cbtree_head *hi = victim_low ? target : victim;
+	unsigned long key[MAX_KEYLEN];
+	unsigned long *lo_leaf, *hi_leaf, *leaf, *node;
+	bool swapped = target->height < victim->height;
+	int level, fill, err;
 
-	for (height = head->height; height > level; height--) {
-		for (i = 0; i < geo->no_pairs; i++)
-			if (keycmp(geo, node, i, key) <= 0)
-				break;
+	lo_leaf = edge_leaf(geo, lo->node, lo->height, false);
+	hi_leaf = edge_leaf(geo, hi->node, hi->height, true);
 
-		if ((i == geo->no_pairs) || !bval(geo, node, i)) {
-			/* right-most key is too large, update it */
-			/* FIXME: If the right-most key on higher levels is
-			 * always zero, this wouldn't be necessary. */
-			i--;
-			setkey(geo, node, i, key);
-		}
-		BUG_ON(i < 0);
-		node = bval(geo, node, i);
+	/*
+	 * The last keys along @hi's lower edge may be stale, lower than its
+	 * smallest key and even lower than keys of @lo.  Raise them to it so
+	 * that @lo's keys are sorted below them.
+	 */
+	getkey(geo, hi_leaf, getfill(geo, hi_leaf, 0) - 1, key);
+	for (node = hi->node, level = hi->height; level > 1; level--) {
+		fill = getfill(geo, node, 0);
+		setkey(geo, node, fill - 1, key);
+		node = bval(geo, node, fill - 1);
 	}
-	BUG_ON(!node);
-	return node;
-}
 
-static int cbtree_grow(struct cbtree_head *head, struct cbtree_geo *geo,
-		      gfp_t gfp)
-{
-	unsigned long *node;
-	int fill;
-	//printk("2-1");
-	node = cbtree_node_alloc(head, geo, gfp);
-	//printk("2-2");
-	if (!node)
-		return -ENOMEM;
-	if (head->node) {
-		//printk("2-3");
-		fill = getfill(geo, head->node, 0);
-		setkey(geo, node, 0, bkey(geo, head->node, fill - 1));
-		setval(geo, node, 0, head->node);
+	if (swapped) {
+		swap(target->node, victim->node);
+		swap(target->height, victim->height);
 	}
-	//printk("2-4");
-	head->node = node;
-	head->height++;
+	node = victim->node;
+	level = victim->height;
+	/* the root's keys may be stale, the smallest leaf's are exact */
+	leaf = edge_leaf(geo, node, level, true);
+	getkey(geo, leaf, getfill(geo, leaf, 0) - 1, key);
+	err = cbtree_insert_level(target, geo, key, node, level + 1, gfp);
+	if (err) {
+		if (swapped) {
+			swap(target->node, victim->node);
+			swap(target->height, victim->height);
+		}
+		return err;
+	}
+	leaf_set_next(geo, lo_leaf, hi_leaf);
+	leaf_set_prev(geo, hi_leaf, lo_leaf);
+	set_root(victim, NULL, 0);
+	victim->seq++;
+	target->seq++;
+	nodes_moved(victim);
+
+	fill = getfill(geo, node, 0);
+	if (fill < rebalance_fill(target, geo))
+		rebalance(target, geo, key, level, node, fill);
 	return 0;
 }
 
-static void cbtree_shrink(struct cbtree_head *head, struct cbtree_geo *geo)
+/*
+ * The changes cbtree_merge() makes to a CBTREE_RCU tree go in write
+ * sections, which hold up its readers, so only the steps that take a
+ * bounded time run in one.  The rest happens with the other writers
+ * stopped: reading the leaf chains, inserting a small victim one entry
+ * per section, and building the union of both trees, which replaces the
+ * target root at once.  Readers may find an entry of the victim in both
+ * trees until the victim is emptied.
+ */
+static void merge_write_begin(struct cbtree_head *target,
+		struct cbtree_head *victim)
 {
-	unsigned long *node;
-	int fill;
-
-	if (head->height <= 1)
-		return;
+	if (target->flags & CBTREE_RCU)
+		cbtree_write_begin(target, 0);
+	if (victim->flags & CBTREE_RCU)
+		cbtree_write_begin(victim, SINGLE_DEPTH_NESTING);
+}
 
-	node = head->node;
-	fill = getfill(geo, node, 0);
-	BUG_ON(fill > 1);
-	head->node = bval(geo, node, 0);
-	head->height--;
-	freeQueue(&node[geo->keylen * geo->no_pairs + geo->no_longs], head, geo->keylen * geo->no_pairs + geo->no_longs);
-	mempool_free(node, head->mempool);
+static void merge_write_end(struct cbtree_head *target,
+		struct cbtree_head *victim)
+{
+	if (victim->flags & CBTREE_RCU)
+		cbtree_write_end(victim);
+	if (target->flags & CBTREE_RCU)
+		cbtree_write_end(target);
 }
 
-static int cbtree_insert_level(struct cbtree_head *head, struct cbtree_geo *geo,
-			      unsigned long *key, void *val, int level,
-			      gfp_t gfp)
+static int __cbtree_merge(struct cbtree_head *target,
+		struct cbtree_head *victim, struct cbtree_geo *geo, gfp_t gfp)
 {
-	unsigned long *node;
-	int i, pos, fill, err;
-	//printk("2");
-	BUG_ON(!val);
-	if (head->height < level) {
-		err = cbtree_grow(head, geo, gfp);
-		if (err)
-			return err;
+	bool rcu = (target->flags | victim->flags) & CBTREE_RCU;
+	struct bulk_merge m = { .src.next = bulk_merge_next };
+	struct cbtree_geo *tgeo, *vgeo;
+	unsigned long tkey[MAX_KEYLEN], vkey[MAX_KEYLEN];
+	unsigned long *leaf, *old = NULL, *node;
+	bool graft = false, low = false, rebuilt = false;
+	size_t n, done;
+	int height, new_height, err;
+
+	if (!victim->node)
+		return 0;
+	if (!target->node && same_nodes(target, victim)) {
+		/* target is empty, just copy fields over */
+		merge_write_begin(target, victim);
+		set_root(target, victim->node, victim->height);
+		target->seq++;
+		nodes_moved(victim);
+		__cbtree_init(victim);
+		merge_write_end(target, victim);
+		return 0;
 	}
-	//printk("3");
-retry:
-	node = find_level(head, geo, key, level);
-	pos = getpos(geo, node, key);
-	fill = getfill(geo, node, pos);
-	/* two identical keys are not allowed */
-	BUG_ON(pos < fill && keycmp(geo, node, pos, key) == 0);
-	//printk("4");
-	if (fill == geo->no_pairs) {
-		/* need to split node */
-		unsigned long *new;
 
-		new = cbtree_node_alloc(head, geo, gfp);
-		// printk("new node allock : %d",new);
-		if (!new)
-			return -ENOMEM;
-		err = cbtree_insert_level(head, geo,
-				bkey(geo, node, fill / 2 - 1),
-				new, level + 1, gfp);
-		if (err) {
-			mempool_free(new, head->mempool);
-			return err;
+	tgeo = tree_geo(target, geo);
+	vgeo = tree_geo(victim, geo);
+	merge_side_init(&m.side[1], victim, vgeo);
+
+	if (target->node && same_nodes(target, victim)) {
+		/* victim's largest key against target's smallest and back */
+		leaf = edge_leaf(tgeo, target->node, target->height, true);
+		getkey(tgeo, leaf, getfill(tgeo, leaf, 0) - 1, tkey);
+		graft = low = longcmp(m.side[1].key, tkey, tgeo->keylen) < 0;
+		if (!graft) {
+			leaf = edge_leaf(tgeo, target->node, target->height,
+					false);
+			getkey(tgeo, leaf, 0, tkey);
+			leaf = edge_leaf(vgeo, victim->node, victim->height,
+					true);
+			getkey(vgeo, leaf, getfill(vgeo, leaf, 0) - 1, vkey);
+			graft = longcmp(vkey, tkey, tgeo->keylen) > 0;
 		}
-		for (i = 0; i < fill / 2; i++) {
-			setkey(geo, new, i, bkey(geo, node, i));
-			setval(geo, new, i, bval(geo, node, i));
-			setkey(geo, node, i, bkey(geo, node, i + fill / 2));
-			setval(geo, node, i, bval(geo, node, i + fill / 2));
-			clearpair(geo, node, i + fill / 2);
-		}
-		if (fill & 1) {
-			setkey(geo, node, i, bkey(geo, node, fill - 1));
-			setval(geo, node, i, bval(geo, node, fill - 1));
-			clearpair(geo, node, fill - 1);
+	}
+	if (graft) {
+		if (rcu) {
+			/* a split on every level of the taller tree */
+			err = cbtree_reserve(target,
+					max(target->height, victim->height) + 1,
+					gfp);
+			if (err)
+				return err;
+			gfp = cbtree_write_gfp(gfp);
 		}
-		goto retry;
+		merge_write_begin(target, victim);
+		err = merge_graft(target, victim, tgeo, low, gfp);
+		merge_write_end(target, victim);
+		return err;
 	}
-	BUG_ON(fill >= geo->no_pairs);
-	//printk("5");
-	/* shift and insert */
-	for (i = fill; i > pos; i--) {
-		setkey(geo, node, i, bkey(geo, node, i - 1));
-		setval(geo, node, i, bval(geo, node, i - 1));
+
+	n = merge_count(&m.side[1]);
+	if (target->node &&
+	    n * target->height < merge_estimate(target, tgeo)) {
+		/* a small victim: insert its entries, undo them on failure */
+		for (done = 0; done < n; done++) {
+			longcpy(vkey, m.side[1].key, vgeo->keylen);
+			node = merge_side_next(&m.side[1]);
+			if (target->flags & CBTREE_RCU)
+				err = insert_locked(target, tgeo, vkey, node,
+						gfp);
+			else
+				err = __cbtree_insert(target, tgeo, vkey, node,
+						gfp);
+			if (err)
+				break;
+		}
+		if (done < n) {
+			merge_side_init(&m.side[1], victim, vgeo);
+			while (done--) {
+				longcpy(vkey, m.side[1].key, vgeo->keylen);
+				if (target->flags & CBTREE_RCU)
+					remove_locked(target, tgeo, vkey);
+				else
+					__cbtree_remove(target, tgeo, vkey);
+				merge_side_next(&m.side[1]);
+			}
+			return err;
+		}
+	} else {
+		/* rebuild target from both leaf chains */
+		merge_side_init(&m.side[0], target, tgeo);
+		n += merge_count(&m.side[0]);
+		err = bulk_build(target, tgeo, &m.src, n, CBTREE_MERGE_FILL,
+				gfp, &node, &new_height);
+		if (err)
+			return err;
+		rebuilt = true;
 	}
-	setkey(geo, node, pos, key);
-	setval(geo, node, pos, val);
 
+	merge_write_begin(target, victim);
+	if (rebuilt) {
+		old = target->node;
+		height = target->height;
+		set_root(target, node, new_height);
+		target->seq++;
+	}
+	node = victim->node;
+	new_height = victim->height;
+	set_root(victim, NULL, 0);
+	victim->seq++;
+	merge_write_end(target, victim);
+
+	if (old)
+		merge_free(target, tgeo, old, height);
+	merge_free(victim, vgeo, node, new_height);
 	return 0;
 }
 
-int cbtree_insert(struct cbtree_head *head, struct cbtree_geo *geo,
-		unsigned long *key, void *val, gfp_t gfp)
+/*
+ * Both trees are locked, in the order of the callers' arguments.  Callers
+ * that merge two trees in both directions at once have to order the calls
+ * themselves.
+ */
+int cbtree_merge(struct cbtree_head *target, struct cbtree_head *victim,
+		struct cbtree_geo *geo, gfp_t gfp)
 {
-	BUG_ON(!val);
-	// printk("1");
-	return cbtree_insert_level(head, geo, key, val, 1, gfp);
-}
-EXPORT_SYMBOL_GPL(cbtree_insert);
+	bool rcu = (target->flags | victim->flags) & CBTREE_RCU;
+	int err;
 
-static void *cbtree_remove_level(struct cbtree_head *head, struct cbtree_geo *geo,
-		unsigned long *key, int level);
-static void merge(struct cbtree_head *head, struct cbtree_geo *geo, int level,
-		unsigned long *left, int lfill,
-		unsigned long *right, int rfill,
-		unsigned long *parent, int lpos)
-{
-	int i;
-	unsigned long *cache_ptr; 									// cache pointer
+	BUG_ON(target == victim);
 
-	
-	for (i = 0; i < rfill; i++) {
-		/* Move all keys to the left */
-		setkey(geo, left, lfill + i, bkey(geo, right, i));
-		setval(geo, left, lfill + i, bval(geo, right, i));
-	}
-	/* Exchange left and right child in parent */
-	setval(geo, parent, lpos, right);
-	setval(geo, parent, lpos + 1, left);
-	/* Remove left (formerly right) child from parent */
-	cbtree_remove_level(head, geo, bkey(geo, parent, lpos), level + 1);
-	
-	////////////////////////// added code to free cache memory
-	////////////////////////// in this if statement allocated node really deleted
-	cache_ptr = right;
-	freeQueue(&cache_ptr[geo->keylen * geo->no_pairs + geo->no_longs],head,geo->keylen * geo->no_pairs + geo->no_longs);
-	//////////////////////////cache memory free
+	if (likely(!rcu))
+		return __cbtree_merge(target, victim, geo, gfp);
+
+	mutex_lock(&target->lock);
+	mutex_lock_nested(&victim->lock, SINGLE_DEPTH_NESTING);
+	cbtree_writers_stop(target);
+	cbtree_writers_stop(victim);
+	err = __cbtree_merge(target, victim, geo, gfp);
+	cbtree_writers_start(victim);
+	cbtree_writers_start(target);
+	mutex_unlock(&victim->lock);
+	mutex_unlock(&target->lock);
+	return err;
+}
+EXPORT_SYMBOL_GPL(cbtree_merge);
 
-	if(cache_ptr[geo->keylen * geo->no_pairs + geo->no_longs + 1] == 0){
-		mempool_free(right, head->mempool);
-	}
-	else{
-		cache_ptr[geo->keylen * geo->no_pairs + geo->no_longs + 2] = 1;	
+/*
+ * Split @leaf at @key: the entries at or above it go to the front of the
+ * empty @new, which takes the place of @leaf in the chain of larger keys.
+ */
+static void split_leaf(struct cbtree_geo *geo, unsigned long *leaf,
+		unsigned long *new, unsigned long *key, int *hi, int *lo)
+{
+	unsigned long *next = leaf_next(geo, leaf);
+	int i, q, fill;
+
+	fill = getfill(geo, leaf, 0);
+	q = getpos(geo, leaf, key);
+	if (q < fill && keycmp(geo, leaf, q, key) == 0)
+		q++;
+	for (i = 0; i < q; i++)
+		movepair(geo, new, i, leaf, i);
+	for (i = q; i < fill; i++)
+		movepair(geo, leaf, i - q, leaf, i);
+	for (i = fill - q; i < fill; i++)
+		clearpair(geo, leaf, i);
+
+	/* the chain breaks between the two trees */
+	if (q) {
+		leaf_set_next(geo, new, next);
+		leaf_set_prev(geo, next, new);
+		next = new;
 	}
-	//not free node, just chang cache state
-	//mempool_free(right, head->mempool);    //this is original code
+	if (fill - q)
+		leaf_set_next(geo, leaf, NULL);
+	else
+		leaf_set_next(geo, leaf_prev(geo, leaf), NULL);
+	leaf_set_prev(geo, next, NULL);
+	*hi = q;
+	*lo = fill - q;
 }
 
-static void rebalance(struct cbtree_head *head, struct cbtree_geo *geo,
-		unsigned long *key, int level, unsigned long *child, int fill)
+static int __cbtree_split(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, struct cbtree_head *out, gfp_t gfp)
 {
-	unsigned long *parent, *left = NULL, *right = NULL;
-	int i, no_left, no_right;
-	unsigned long *cache_ptr; 									// cache pointer
-
-	if (fill == 0) {
-		/* Because we don't steal entries from a neighbour, this case
-		 * can happen.  Parent node contains a single child, this
-		 * node, so merging with a sibling never happens.
-		 */
-		cbtree_remove_level(head, geo, key, level + 1);
-
-		////////////////////////// added code to free cache memory
-		////////////////////////// in this if statement allocated node really deleted
-		cache_ptr = child;
-		freeQueue(&cache_ptr[geo->keylen * geo->no_pairs + geo->no_longs],head,geo->keylen * geo->no_pairs + geo->no_longs);
-		//////////////////////////cache memory free
+	unsigned long *path[CBTREE_MAX_PATH], *new[CBTREE_MAX_PATH];
+	unsigned long edge[MAX_KEYLEN];
+	unsigned long *node, *hi_node, *lo_node;
+	int height, level, i, c, fill, no_hi, no_lo;
+
+	if (out->node)
+		return -EEXIST;
+	if (!same_nodes(head, out))
+		return -EINVAL;
+	if (!head->node)
+		return 0;
 
-		if(cache_ptr[geo->keylen * geo->no_pairs + geo->no_longs + 1] == 0){
-		mempool_free(right, head->mempool);
-		}
-		else{
-			cache_ptr[geo->keylen * geo->no_pairs + geo->no_longs + 2] = 1;	
+	height = head->height;
+	/* one node per level, taken up front so the split cannot fail */
+	for (level = 1; level <= height; level++) {
+		new[level - 1] = cbtree_node_alloc(out, geo, gfp);
+		if (!new[level - 1]) {
+			while (--level)
+				cbtree_free_node(out, geo, new[level - 1]);
+			return -ENOMEM;
 		}
-		//not free node, just chang cache state
-		//mempool_free(right, head->mempool);    //this is original code
-		return;
 	}
 
-	parent = find_level(head, geo, key, level + 1);
-	i = getpos(geo, parent, key);
-	BUG_ON(bval(geo, parent, i) != child);
-
-	if (i > 0) {
-		left = bval(geo, parent, i - 1);
-		no_left = getfill(geo, left, 0);
-		if (fill + no_left <= geo->no_pairs) {
-			merge(head, geo, level,
-					left, no_left,
-					child, fill,
-					parent, i - 1);
-			return;
-		}
-	}
-	if (i + 1 < getfill(geo, parent, i)) {
-		right = bval(geo, parent, i + 1);
-		no_right = getfill(geo, right, 0);
-		if (fill + no_right <= geo->no_pairs) {
-			merge(head, geo, level,
-					child, fill,
-					right, no_right,
-					parent, i);
-			return;
-		}
+	node = head->node;
+	for (level = height; level > 1; level--) {
+		path[level - 1] = node;
+		c = getpos(geo, node, key);
+		if (c == getfill(geo, node, 0))
+			c--;	/* every child is above @key */
+		node = bval(geo, node, c);
 	}
+	split_leaf(geo, node, new[0], key, &no_hi, &no_lo);
+	hi_node = no_hi ? new[0] : NULL;
+	lo_node = no_lo ? node : NULL;
+	if (!no_hi)
+		cbtree_free_node(out, geo, new[0]);
+	if (!no_lo)
+		cbtree_free_node(head, geo, node);
+
 	/*
-	 * We could also try to steal one entry from the left or right
-	 * neighbor.  By not doing so we changed the invariant from
-	 * "all nodes are at least half full" to "no two neighboring
-	 * nodes can be merged".  Which means that the average fill of
-	 * all nodes is still half or better.
+	 * On the way up, the children before the one on the path go to the
+	 * new node of the level, after the upper part of the path child.
+	 * The lower part of the path child and the children after it stay.
 	 */
-}
-
-static void *cbtree_remove_level(struct cbtree_head *head, struct cbtree_geo *geo,
-		unsigned long *key, int level)
-{
-	unsigned long *node;
-	int i, pos, fill;
-	void *ret;
-
-	if (level > head->height) {
-		/* we recursed all the way up */
-		head->height = 0;
-		head->node = NULL;
-		return NULL;
+	for (level = 2; level <= height; level++) {
+		node = path[level - 1];
+		fill = getfill(geo, node, 0);
+		c = getpos(geo, node, key);
+		if (c == fill)
+			c--;
+		for (i = 0; i < c; i++)
+			movepair(geo, new[level - 1], i, node, i);
+		no_hi = c;
+		if (hi_node) {
+			setkey(geo, new[level - 1], no_hi, key);
+			setval(geo, new[level - 1], no_hi++, hi_node);
+		}
+		no_lo = 0;
+		if (lo_node)
+			movepair(geo, node, no_lo++, node, c);
+		for (i = c + 1; i < fill; i++)
+			movepair(geo, node, no_lo++, node, i);
+		for (i = no_lo; i < fill; i++)
+			clearpair(geo, node, i);
+
+		hi_node = no_hi ? new[level - 1] : NULL;
+		if (!no_hi)
+			cbtree_free_node(out, geo, new[level - 1]);
+		lo_node = no_lo ? node : NULL;
+		/* its cache may point to leaves in @out, nodes_moved() drops it */
+		if (!no_lo)
+			cbtree_free_node(head, geo, node);
 	}
 
-	node = find_level(head, geo, key, level);
-	pos = getpos(geo, node, key);
-	fill = getfill(geo, node, pos);
-	if ((level == 1) && (keycmp(geo, node, pos, key) != 0))
-		return NULL;
-	ret = bval(geo, node, pos);
-	
-	/* remove and shift */
-	for (i = pos; i < fill - 1; i++) {
-		setkey(geo, node, i, bkey(geo, node, i + 1));
-		setval(geo, node, i, bval(geo, node, i + 1));
-	}
-		clearpair(geo, node, fill - 1);
+	set_root(head, lo_node, lo_node ? height : 0);
+	head->seq++;
+	nodes_moved(head);
+	set_root(out, hi_node, hi_node ? height : 0);
+	out->seq++;
 
-	if (fill - 1 < geo->no_pairs / 2) {
-		if (level < head->height)
-			rebalance(head, geo, key, level, node, fill - 1);
-		else if (fill - 1 == 1)
+	/* only the nodes along the cut can be underfull */
+	if (__cbtree_last(head, geo, edge)) {
+		range_fixup(head, geo, edge);
+		while (head->height > 1 && getfill(geo, head->node, 0) == 1)
 			cbtree_shrink(head, geo);
 	}
-
-	return ret;
-}
-
-void *cbtree_remove(struct cbtree_head *head, struct cbtree_geo *geo,
-		unsigned long *key)
-{
-	if (head->height == 0)
-		return NULL;
-
-	return cbtree_remove_level(head, geo, key, 1);
+	if (__cbtree_first(out, geo, edge)) {
+		range_fixup(out, geo, edge);
+		while (out->height > 1 && getfill(geo, out->node, 0) == 1)
+			cbtree_shrink(out, geo);
+	}
+	return 0;
 }
-EXPORT_SYMBOL_GPL(cbtree_remove);
 
-int cbtree_merge(struct cbtree_head *target, struct cbtree_head *victim,
-		struct cbtree_geo *geo, gfp_t gfp)
+int cbtree_split(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, struct cbtree_head *out, gfp_t gfp)
 {
-	unsigned long key[MAX_KEYLEN];
-	unsigned long dup[MAX_KEYLEN];
-	void *val;
+	bool rcu = (head->flags | out->flags) & CBTREE_RCU;
 	int err;
 
-	BUG_ON(target == victim);
-
-	if (!(target->node)) {
-		/* target is empty, just copy fields over */
-		target->node = victim->node;
-		target->height = victim->height;
-		__cbtree_init(victim);
-		return 0;
-	}
-
-	/* TODO: This needs some optimizations.  Currently we do three tree
-	 * walks to remove a single object from the victim.
-	 */
-	for (;;) {
-		if (!cbtree_last(victim, geo, key))
-			break;
-		val = cbtree_lookup(victim, geo, key);
-		err = cbtree_insert(target, geo, key, val, gfp);
-		if (err)
-			return err;
-		/* We must make a copy of the key, as the original will get
-		 * mangled inside cbtree_remove. */
-		longcpy(dup, key, geo->keylen);
-		cbtree_remove(victim, geo, dup);
+	BUG_ON(head == out);
+
+	geo = tree_geo(head, geo);
+	if (likely(!rcu))
+		return __cbtree_split(head, geo, key, out, gfp);
+
+	mutex_lock(&head->lock);
+	mutex_lock_nested(&out->lock, SINGLE_DEPTH_NESTING);
+	/* the new node of every level */
+	err = cbtree_reserve(out, head->height, gfp);
+	if (!err) {
+		cbtree_write_begin(head, 0);
+		cbtree_write_begin(out, SINGLE_DEPTH_NESTING);
+		err = __cbtree_split(head, geo, key, out, cbtree_write_gfp(gfp));
+		cbtree_write_end(out);
+		cbtree_write_end(head);
 	}
-	return 0;
+	mutex_unlock(&out->lock);
+	mutex_unlock(&head->lock);
+	return err;
 }
-EXPORT_SYMBOL_GPL(cbtree_merge);
+EXPORT_SYMBOL_GPL(cbtree_split);
 
 static size_t __cbtree_for_each(struct cbtree_head *head, struct cbtree_geo *geo,
 			       unsigned long *node, unsigned long opaque,
@@ -817,25 +3502,63 @@ static size_t __cbtree_for_each(struct cbtree_head *head, struct cbtree_geo *geo
 {
 	int i;
 	unsigned long *child;
+	unsigned long key[MAX_KEYLEN];
 
 	for (i = 0; i < geo->no_pairs; i++) {
 		child = bval(geo, node, i);
 		if (!child)
 			break;
-		if (height > 1)
+		if (height > 1) {
 			count = __cbtree_for_each(head, geo, child, opaque,
 					func, func2, reap, height - 1, count);
-		else
-			func(child, opaque, bkey(geo, node, i), count++,
-					func2);
+		} else {
+			getkey(geo, node, i, key);
+			func(child, opaque, key, count++, func2);
+		}
 	}
-	if (reap){
-		freeQueue(&node[geo->keylen * geo->no_pairs + geo->no_longs], head, geo->keylen * geo->no_pairs + geo->no_longs);
+	if (reap)
 		mempool_free(node, head->mempool);
-	}
 	return count;
 }
 
+static void __cbtree_stats(struct cbtree_geo *geo, unsigned long *node,
+		int height, struct cbtree_stats *stats)
+{
+	unsigned long *child;
+	int i, fill = getfill(geo, node, 0);
+
+	stats->nodes++;
+	if (height <= 1) {
+		stats->leaves++;
+		stats->entries += fill;
+		stats->slots += geo->no_pairs;
+		return;
+	}
+	for (i = 0; i < fill; i++) {
+		child = bval(geo, node, i);
+		stats->min_fill = min(stats->min_fill, getfill(geo, child, 0));
+		__cbtree_stats(geo, child, height - 1, stats);
+	}
+}
+
+void cbtree_stats(struct cbtree_head *head, struct cbtree_geo *geo,
+		  struct cbtree_stats *stats)
+{
+	geo = tree_geo(head, geo);
+	memset(stats, 0, sizeof(*stats));
+	stats->height = head->height;
+	if (head->height > 1)
+		stats->min_fill = geo->no_pairs;
+	if (head->node)
+		__cbtree_stats(geo, head->node, head->height, stats);
+	stats->cache_bytes = stats->nodes * queueBytes();
+	if (head->hot)
+		stats->cache_bytes += struct_size(head->hot, e,
+				1UL << head->hot->bits);
+	stats->bytes = stats->nodes * geo->nodesize + stats->cache_bytes;
+}
+EXPORT_SYMBOL_GPL(cbtree_stats);
+
 static void empty(void *elem, unsigned long opaque, unsigned long *key,
 		  size_t index, void *func2)
 {
@@ -854,9 +3577,8 @@ void cvisitor32(void *elem, unsigned long opaque, unsigned long *__key,
 	       size_t index, void *__func)
 {
 	visitor32_t func = __func;
-	u32 *key = (void *)__key;
 
-	func(elem, opaque, *key, index);
+	func(elem, opaque, *__key, index);
 }
 EXPORT_SYMBOL_GPL(cvisitor32);
 
@@ -887,10 +3609,20 @@ size_t cbtree_visitor(struct cbtree_head *head, struct cbtree_geo *geo,
 		     		  size_t index, void *func2),
 		     void *func2)
 {
+	unsigned long key[MAX_KEYLEN] = { 0 };
 	size_t count = 0;
+	void *elem;
 
+	geo = tree_geo(head, geo);
 	if (!func2)
 		func = empty;
+	if (head->flags & CBTREE_RCU) {
+		/* each step is a search of its own, @func may sleep */
+		for (elem = cbtree_read(head, geo, key, rcu_last); elem;
+		     elem = cbtree_read(head, geo, key, rcu_prev))
+			func(elem, opaque, key, count++, func2);
+		return count;
+	}
 	if (head->node)
 		count = __cbtree_for_each(head, geo, head->node, opaque, func,
 				func2, 0, head->height, 0);
@@ -905,14 +3637,33 @@ size_t cbtree_grim_visitor(struct cbtree_head *head, struct cbtree_geo *geo,
 				       size_t index, void *func2),
 			  void *func2)
 {
+	bool rcu = head->flags & CBTREE_RCU;
+	unsigned long *node;
 	size_t count = 0;
+	int height;
 
+	geo = tree_geo(head, geo);
 	if (!func2)
 		func = empty;
-	if (head->node)
-		count = __cbtree_for_each(head, geo, head->node, opaque, func,
-				func2, 1, head->height, 0);
+	if (rcu)
+		mutex_lock(&head->lock);
+	node = head->node;
+	height = head->height;
+	if (rcu) {
+		cbtree_write_begin(head, 0);
+		set_root(head, NULL, 0);
+		cbtree_write_end(head);
+		/* lockless readers may still be on the detached nodes */
+		synchronize_rcu();
+	}
+	if (node)
+		count = __cbtree_for_each(head, geo, node, opaque, func,
+				func2, 1, height, 0);
+	limbo_flush(head);
+	reserve_free(head);
 	__cbtree_init(head);
+	if (rcu)
+		mutex_unlock(&head->lock);
 	return count;
 }
 EXPORT_SYMBOL_GPL(cbtree_grim_visitor);
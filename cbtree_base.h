@@ -4,14 +4,18 @@
 
 #include <linux/kernel.h>
 #include <linux/mempool.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
 
 /**
  * DOC: B+Tree basics
  *
  * A B+Tree is a data structure for looking up arbitrary (currently allowing
  * unsigned long, u32, u64 and 2 * u64) keys into pointers. The data structure
- * is described at https://en.wikipedia.org/wiki/B-tree, we currently do not
- * use binary search to find the key on lookups.
+ * is described at https://en.wikipedia.org/wiki/B-tree.  Keys inside a node
+ * are found with a linear scan for small nodes and with a binary search for
+ * geometries of at least cbtree_bsearch_pairs pairs.
  *
  * Each B+Tree consists of a head, that contains bookkeeping information and
  * a variable number (starting with zero) nodes. Each node contains the keys
@@ -25,21 +29,270 @@
  * number of keys and values (N) is geo->no_pairs.
  */
 
+/**
+ * struct cbtree_geo - cbtree geometry
+ *
+ * @keylen: number of longs per key
+ * @no_pairs: number of key/value pairs per node
+ * @no_longs: number of longs used by the keys of a node
+ * @nodesize: size of a node in bytes
+ * @packed: keys are stored as u32 (keylen is 1), see cbtree_geo32p
+ */
+struct cbtree_geo {
+	int keylen;
+	int no_pairs;
+	int no_longs;
+	unsigned int nodesize;
+	bool packed;
+};
+
+/*
+ * Every inner node caches the leaves a sample of the recent lookups through
+ * it ended in (see CBTREE_CACHE_FILL), in up to CBTREE_CACHE_WAYS ways (see
+ * CBTREE_NODE_BYTES()).  A tree can use fewer ways on some levels:
+ * @cache_ways[0] applies to the parents of the leaves, @cache_ways[1] to
+ * the level above and so on, the last entry to all remaining levels; 0
+ * uses all ways.  @cache_policy picks the way a new entry replaces:
+ *
+ * CBTREE_CACHE_RR: round robin, the default.
+ * CBTREE_CACHE_CLOCK: CLOCK, a hit sets the reference bit of its way and
+ *	entries are added without it, so keys seen once go first.
+ * CBTREE_CACHE_LFU: the way with the fewest hits, counted in a small
+ *	saturating counter; all counters of a node halve when one saturates.
+ *
+ * Both fields are cleared by the init functions and may be changed at any
+ * time, the ways beyond a lowered count are just no longer used.
+ */
+#ifndef CBTREE_CACHE_WAYS
+#define CBTREE_CACHE_WAYS	4
+#endif
+#define CBTREE_CACHE_LEVELS	4
+
+#define CBTREE_CACHE_RR		0
+#define CBTREE_CACHE_CLOCK	1
+#define CBTREE_CACHE_LFU	2
+
 /**
  * struct cbtree_head - cbtree head
  *
  * @node: the first node in the tree
  * @mempool: mempool used for node allocations
  * @height: current of the tree
+ * @cachep: node cache of a tree set up by cbtree_init_nodesize(), else %NULL
+ * @cachep_name: name of @cachep
+ * @geo: geometry for the node size of @cachep
+ * @flags: CBTREE_* behaviour flags, cleared by the init functions
+ * @append_fill: split policy for appends, see below
+ * @seq: bumped by every insert and remove
+ * @cursor: leaf of the entry returned last by cbtree_first(), cbtree_last(),
+ *	cbtree_get_next() or cbtree_get_prev()
+ * @cursor_pos: slot of that entry in @cursor
+ * @cursor_seq: @seq at the time @cursor was saved
+ * @cache_policy: replacement policy of the per-node lookup caches
+ * @cache_ways: ways of the per-node caches used per level, see below
+ * @hot: hot-key table set up by cbtree_init_hot(), else %NULL
+ * @finger: per-CPU leaf of the last lookup, %NULL for trees set up with
+ *	cbtree_init_mempool()
+ * @node_gen: bumped whenever a node is freed or moves to another tree
+ * @cache_epoch: epoch of the node caches, unique among all trees
+ * @limbo: nodes unlinked from the tree that are not freed yet
+ * @limbo_nr: number of nodes on @limbo
+ * @reserve: nodes allocated ahead for the next insert of a CBTREE_RCU tree
+ * @reserve_nr: number of nodes on @reserve
+ * @lock: serializes the writers of a CBTREE_RCU tree
+ * @write_seq: odd while a writer changes a CBTREE_RCU tree
+ * @writers: per-CPU count of the writers of a CBTREE_RCU tree that only
+ *	lock the nodes they change, %NULL for trees set up with
+ *	cbtree_init_mempool()
  */
 struct cbtree_head {
 	unsigned long *node;
 	mempool_t *mempool;
 	int height;
+	struct kmem_cache *cachep;
+	char *cachep_name;
+	struct cbtree_geo geo;
+	unsigned int flags;
+	int append_fill;
+	unsigned long seq;
+	unsigned long *cursor;
+	int cursor_pos;
+	unsigned long cursor_seq;
+	unsigned char cache_policy;
+	unsigned char cache_ways[CBTREE_CACHE_LEVELS];
+	struct cbtree_hot *hot;
+	struct cbtree_finger __percpu *finger;
+	u64 node_gen;
+	unsigned long cache_epoch;
+	unsigned long *limbo;
+	unsigned int limbo_nr;
+	unsigned long *reserve;
+	unsigned int reserve_nr;
+	struct mutex lock;
+	seqcount_t write_seq;
+	unsigned int __percpu *writers;
+	bool writers_stopped;
 };
 
-/* cbtree geometry */
-struct cbtree_geo;
+/*
+ * A full node normally splits in half.  When keys arrive in increasing (or
+ * decreasing) order every split happens at the edge of the tree, and the
+ * half left behind is never filled again.  With @append_fill set to a
+ * percentage above 50, a split of the right-most (left-most) node of its
+ * level whose new entry goes above (below) all of its keys leaves
+ * @append_fill percent of the entries in place and moves the rest to the
+ * new node; 100 moves a single entry, which in effect starts a new node.
+ * Splits anywhere else stay even.  0, the default, disables the policy;
+ * CBTREE_APPEND_FILL suits trees that mostly see appends.
+ */
+#define CBTREE_APPEND_FILL	90
+
+/*
+ * CBTREE_PREFETCH: on every level of a descent, prefetch the key lines and
+ * the cache slots of the chosen child before probing the current node's
+ * cache.  This hides part of the miss latency on trees much larger than
+ * the LLC and costs a few extra instructions on trees that fit in cache.
+ */
+#define CBTREE_PREFETCH		0x1
+
+/*
+ * CBTREE_BORROW: keep nodes at least two thirds full instead of half full.
+ * A node that drops below that is merged with a neighbour if they fit in
+ * one node, emptied into both neighbours if the three fit in two, and
+ * otherwise evened out with its fuller neighbour.  Costs more entry moves
+ * on removal and saves nodes, and often a level, after delete-heavy phases.
+ */
+#define CBTREE_BORROW		0x2
+
+/*
+ * CBTREE_RCU: lockless readers.  cbtree_lookup(), cbtree_first(),
+ * cbtree_last(), cbtree_get_next(), cbtree_get_prev() and cbtree_visitor()
+ * may run concurrently with each other and with the writers, without any
+ * lock of the caller; they take rcu_read_lock() themselves.  The functions
+ * that change the tree take the tree's own mutex, so writers may race
+ * each other too, but they sleep and must not be called under
+ * rcu_read_lock() or a spinlock.
+ *
+ * Inserts, removes and updates that change a single leaf, or split a node
+ * whose parent has room, skip the mutex.  They lock only the nodes they
+ * change, through a version word in the node, so writers on different
+ * parts of the tree run in parallel; a writer whose nodes changed under
+ * it starts over.  Root splits, removes that leave a leaf underfull and
+ * the other writers take the mutex and wait for those writers to leave
+ * before they begin.  Readers check the version of every node they read.
+ * Trees set up with cbtree_init_mempool() always take the mutex.
+ *
+ * Writers change the tree inside a write_seq section with preemption
+ * disabled.  Nodes are zeroed before they are linked, and unlinked nodes
+ * are only freed after an RCU grace period, so a reader that runs into a
+ * half-done split, merge or shift follows pointers to live memory only;
+ * it then sees write_seq move and repeats its search.  Lookups do not use
+ * the node caches, the hot-key table or the fingers, and the walks do not
+ * use the cursor, which would all write to memory shared by the readers.
+ *
+ * Set the flag after the init function and before the tree is shared; it
+ * survives cbtree_grim_visitor() and cbtree_merge(), unlike the others.
+ * The batch lookups, the iterators and cbtree_stats() still need the
+ * writers excluded by the caller.  Writers allocate their nodes before the
+ * write section.  The long operations keep the sections short: the bulk
+ * load and a merge that rebuilds the target build the new nodes off to
+ * the side and swap the root, a merge of a small victim inserts one entry
+ * per section, and cbtree_remove_range() removes a batch per section and
+ * calls @func outside of it.  Readers can see such an operation half done,
+ * e.g. entries in both trees of a merge.  cbtree_grim_visitor() waits for
+ * the readers before it calls @func, so the entries can be freed right
+ * away.  Trees set up with cbtree_init_mempool() call rcu_barrier() before
+ * the mempool goes away.
+ */
+#define CBTREE_RCU		0x4
+
+/*
+ * Default threshold for cbtree_bsearch_pairs: geometries with at least this
+ * many pairs per node use binary search, smaller ones scan linearly.
+ */
+#define CBTREE_BSEARCH_PAIRS	16
+
+extern int cbtree_bsearch_pairs;
+
+/*
+ * Default for cbtree_limbo_nodes: nodes unlinked from a tree are freed in
+ * batches of this many, each batch empties the tree's node caches.
+ */
+#define CBTREE_LIMBO_NODES	256
+
+extern int cbtree_limbo_nodes;
+
+/*
+ * Default for cbtree_cache_fill: a lookup that missed the node caches
+ * fills them only once in this many misses of a CPU, and only one in this
+ * many hits updates the CLOCK or LFU state of its way.  Probes themselves
+ * only read the node, so lookups on many CPUs share the lines of the upper
+ * nodes instead of bouncing them.  1 fills on every miss.
+ */
+#define CBTREE_CACHE_FILL	8
+
+extern int cbtree_cache_fill;
+
+/*
+ * Built with CBTREE_KEYCMP_STATS defined (make KEYCMP_STATS=y), every
+ * in-node key comparison is counted, so that benchmarks can report
+ * comparisons per operation.  Off by default: the per-CPU increment sits
+ * in the search loops that are being measured.
+ */
+#ifdef CBTREE_KEYCMP_STATS
+DECLARE_PER_CPU(unsigned long, cbtree_keycmp_nr);
+
+/* sum of cbtree_keycmp_nr over all CPUs */
+unsigned long cbtree_keycmp_count(void);
+/* reset cbtree_keycmp_nr on all CPUs */
+void cbtree_keycmp_reset(void);
+#else
+static inline unsigned long cbtree_keycmp_count(void) { return 0; }
+static inline void cbtree_keycmp_reset(void) { }
+#endif
+
+/*
+ * Built with CBTREE_CACHE_STATS defined (make CACHE_STATS=y), the events
+ * of the per-node lookup caches are counted per level, bucketed like
+ * cache_ways.  Off by default, as the per-CPU increments sit in findNode()
+ * and setcache() on every lookup.
+ */
+
+/**
+ * struct cbtree_cache_stats - per-node cache events of one level
+ *
+ * @probes: caches searched for a key
+ * @hits: probes that returned a cached leaf
+ * @misses: probes that did not
+ * @evictions: entries replaced by a new one
+ * @stale: entries for the key skipped because their leaf was retired
+ */
+struct cbtree_cache_stats {
+	unsigned long probes;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long stale;
+};
+
+#ifdef CBTREE_CACHE_STATS
+/* sum of the counters of @level (2 and up) over all CPUs */
+void cbtree_cache_stats(int level, struct cbtree_cache_stats *stats);
+/* reset the counters on all CPUs */
+void cbtree_cache_stats_reset(void);
+/* create and remove the debugfs file cbtree/cache_stats */
+void cbtree_cache_debugfs_init(void);
+void cbtree_cache_debugfs_exit(void);
+#else
+static inline void cbtree_cache_stats(int level,
+				      struct cbtree_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+static inline void cbtree_cache_stats_reset(void) { }
+static inline void cbtree_cache_debugfs_init(void) { }
+static inline void cbtree_cache_debugfs_exit(void) { }
+#endif
 
 /**
  * cbtree_alloc - allocate function for the mempool
@@ -62,7 +315,7 @@ void cbtree_free(void *element, void *pool_data);
  * @mempool: the mempool to use
  *
  * When this function is used, there is no need to destroy
- * the mempool.
+ * the mempool.  Its elements must hold CBTREE_NODE_BYTES(NODESIZE).
  */
 void cbtree_init_mempool(struct cbtree_head *head, mempool_t *mempool);
 
@@ -71,23 +324,57 @@ void cbtree_init_mempool(struct cbtree_head *head, mempool_t *mempool);
  *
  * @head: the cbtree head to initialise
  *
- * This function allocates the memory pool that the
- * cbtree needs. Returns zero or a negative error code
+ * This function allocates the memory pool and the per-CPU lookup
+ * fingers that the cbtree needs. Returns zero or a negative error code
  * (-%ENOMEM) when memory allocation fails.
  *
  */
 int __must_check cbtree_init(struct cbtree_head *head);
 
+/**
+ * cbtree_init_nodesize - initialise a cbtree with its own node size
+ *
+ * @head: the cbtree head to initialise
+ * @geo: geometry whose key length the tree uses
+ * @nodesize: 128, 256, 512, 1024 or PAGE_SIZE bytes
+ *
+ * Like cbtree_init(), but the tree gets its own node cache of @nodesize
+ * bytes and a geometry derived from it, which is used instead of the
+ * geometry passed to the other cbtree functions.  Larger nodes mean more
+ * pairs per node and fewer levels.  Returns zero, -%EINVAL for an
+ * unsupported size or -%ENOMEM.
+ */
+int __must_check cbtree_init_nodesize(struct cbtree_head *head,
+				      struct cbtree_geo *geo,
+				      unsigned int nodesize);
+
 /**
  * cbtree_destroy - destroy mempool
  *
  * @head: the cbtree head to destroy
  *
- * This function destroys the internal memory pool, use only
- * when using cbtree_init(), not with cbtree_init_mempool().
+ * This function destroys the internal memory pool, and the node cache
+ * of trees set up with cbtree_init_nodesize().  Use only when using
+ * cbtree_init() or cbtree_init_nodesize(), not with cbtree_init_mempool().
  */
 void cbtree_destroy(struct cbtree_head *head);
 
+/**
+ * cbtree_init_hot - give a cbtree a hot-key table
+ *
+ * @head: the cbtree, just set up with one of the init functions
+ * @budget: size of the table in bytes
+ *
+ * The table maps recently looked up keys to their leaf and slot and is
+ * checked by cbtree_lookup() before it descends the tree.  It holds the
+ * largest power of two of entries that fits in @budget; a @budget too
+ * small for a probe window removes the table again.  Entries are dropped
+ * whenever a node is freed or nodes move between trees.  cbtree_destroy()
+ * frees the table, trees set up with cbtree_init_mempool() pass a zero
+ * @budget instead.  Returns zero or -%ENOMEM.
+ */
+int __must_check cbtree_init_hot(struct cbtree_head *head, size_t budget);
+
 /**
  * cbtree_lookup - look up a key in the cbtree
  *
@@ -95,11 +382,80 @@ void cbtree_destroy(struct cbtree_head *head);
  * @geo: the cbtree geometry
  * @key: the key to look up
  *
- * This function returns the value for the given key, or %NULL.
+ * This function returns the value for the given key, or %NULL.  A key
+ * that falls within the leaf this CPU's last lookup ended in, or next to
+ * it, is answered from that leaf without descending the tree.
  */
 void *cbtree_lookup(struct cbtree_head *head, struct cbtree_geo *geo,
 		   unsigned long *key);
 
+/**
+ * cbtree_lookup_simd - look up many keys with the vectorized node search
+ *
+ * @head: the cbtree to look in
+ * @geo: the cbtree geometry
+ * @keys: @n keys, geo->keylen longs each
+ * @vals: filled with the value for each key, or %NULL
+ * @n: number of keys
+ *
+ * For single-long keys on CPUs with AVX2 every node is searched with
+ * cbtree_simd_getpos(), CBTREE_SIMD_BATCH lookups per FPU section.  Other
+ * geometries, or cbtree_simd_enabled == 0, use the scalar getpos().  This
+ * path does not consult or fill the per-node caches.  Returns the number
+ * of keys found.
+ */
+size_t cbtree_lookup_simd(struct cbtree_head *head, struct cbtree_geo *geo,
+			 unsigned long *keys, void **vals, size_t n);
+
+/*
+ * Number of descents cbtree_lookup_batch() keeps in flight.  Enough to
+ * cover a DRAM miss with the in-node searches of the other keys, small
+ * enough that the group's nodes stay in L1.
+ */
+#define CBTREE_BATCH_GROUP	16
+
+/**
+ * cbtree_lookup_batch - look up many keys with interleaved descents
+ *
+ * @head: the cbtree to look in
+ * @geo: the cbtree geometry
+ * @keys: @n keys, geo->keylen longs each
+ * @vals: filled with the value for each key, or %NULL
+ * @n: number of keys
+ *
+ * The keys are looked up CBTREE_BATCH_GROUP at a time.  The descents of
+ * a group advance level by level and the next node of each one is
+ * prefetched, so the cache misses of one lookup overlap with the search
+ * work of the others.  Like cbtree_lookup_simd(), this path does not
+ * consult or fill the per-node caches.  Returns the number of keys found.
+ */
+size_t cbtree_lookup_batch(struct cbtree_head *head, struct cbtree_geo *geo,
+			  unsigned long *keys, void **vals, size_t n);
+
+/**
+ * cbtree_bulk_load - build a cbtree from sorted input
+ *
+ * @head: the cbtree to fill, must be empty
+ * @geo: the cbtree geometry
+ * @keys: @n keys, geo->keylen longs each, in strictly ascending order
+ * @vals: the @n values (must not be %NULL)
+ * @n: number of entries
+ * @fill_factor: percentage of each node to fill, 1 to 100
+ *
+ * Builds the leaves and every inner level bottom-up in one pass over the
+ * input, without searching or splitting.  The entries of each level are
+ * spread evenly over its nodes, so no node ends up much emptier than
+ * @fill_factor.  Leave some room (e.g. 90) if the tree will see inserts
+ * afterwards; a full tree splits on the first insert into every node.
+ *
+ * Returns 0 on success, -EEXIST if the tree is not empty, -EINVAL for
+ * unsorted input, a %NULL value or a bad @fill_factor, or -ENOMEM, in
+ * which case the tree is left empty.
+ */
+int __must_check cbtree_bulk_load(struct cbtree_head *head,
+		struct cbtree_geo *geo, unsigned long *keys, void **vals,
+		size_t n, int fill_factor);
+
 /**
  * cbtree_insert - insert an entry into the cbtree
  *
@@ -151,13 +507,63 @@ void *cbtree_remove(struct cbtree_head *head, struct cbtree_geo *geo,
  * The two trees @target and @victim may not contain the same keys,
  * that is a bug and triggers a BUG(). This function returns zero
  * if the trees were merged successfully, and may return a failure
- * when memory allocation fails, in which case both trees might have
- * been partially merged, i.e. some entries have been moved from
- * @victim to @target.
+ * when memory allocation fails, in which case both trees are left
+ * as they were.
+ *
+ * If all keys of @victim lie below or above those of @target and both
+ * take their nodes from the same slab cache, the shorter tree is
+ * grafted into the edge of the other one, which only touches the nodes
+ * along that edge.  A victim much smaller than @target has its entries
+ * inserted.  Otherwise the leaves of both trees are read in key order
+ * and @target is rebuilt from them bottom-up like cbtree_bulk_load(), in
+ * O(n + m) time.  The new nodes are allocated before the old ones are
+ * freed.
  */
 int cbtree_merge(struct cbtree_head *target, struct cbtree_head *victim,
 		struct cbtree_geo *geo, gfp_t gfp);
 
+/**
+ * cbtree_split - move the upper part of a cbtree into another one
+ *
+ * @head: the cbtree to split
+ * @geo: the cbtree geometry
+ * @key: the entries with this key and all larger ones move to @out
+ * @out: an empty cbtree whose nodes come from the same slab cache as
+ *	those of @head, e.g. both set up with cbtree_init()
+ * @gfp: allocation flags
+ *
+ * Only the nodes on the path to @key are cut in two, one new node per
+ * level; everything beside that path changes trees as whole subtrees.
+ * The nodes along the cut are then merged with their neighbours where
+ * they fit and both roots are shrunk, so this takes O(log n) time.
+ * Returns 0, -%EEXIST if @out is not empty, -%EINVAL if its nodes come
+ * from elsewhere, or -%ENOMEM, in which case @head is unchanged.
+ */
+int cbtree_split(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *key, struct cbtree_head *out, gfp_t gfp);
+
+/**
+ * cbtree_remove_range - remove all entries with keys in a range
+ *
+ * @head: the cbtree to remove from
+ * @geo: the cbtree geometry
+ * @lo: lowest key to remove
+ * @hi: highest key to remove
+ * @opaque: passed to @func
+ * @func: called for every removed entry before its node is freed, or %NULL
+ * @func2: passed to @func
+ *
+ * Subtrees entirely inside [@lo, @hi] are detached and freed in one go,
+ * together with their cache queues; only the nodes on the paths to @lo and
+ * @hi are searched and changed, and the nodes next to the hole are merged
+ * with their neighbours afterwards.  Returns the number of removed entries.
+ */
+size_t cbtree_remove_range(struct cbtree_head *head, struct cbtree_geo *geo,
+		unsigned long *lo, unsigned long *hi, unsigned long opaque,
+		void (*func)(void *elem, unsigned long opaque,
+			     unsigned long *key, size_t index, void *func2),
+		void *func2);
+
 /**
  * cbtree_last - get last entry in cbtree
  *
@@ -186,6 +592,158 @@ void *cbtree_last(struct cbtree_head *head, struct cbtree_geo *geo,
 void *cbtree_get_prev(struct cbtree_head *head, struct cbtree_geo *geo,
 		     unsigned long *key);
 
+/**
+ * cbtree_first - get first entry in cbtree
+ *
+ * @head: cbtree head
+ * @geo: cbtree geometry
+ * @key: first key
+ *
+ * Returns the entry with the smallest key, and sets @key to that key;
+ * returns NULL if the tree is empty, in that case key is not changed.
+ */
+void *cbtree_first(struct cbtree_head *head, struct cbtree_geo *geo,
+		  unsigned long *key);
+
+/**
+ * cbtree_get_next - get next entry
+ *
+ * @head: cbtree head
+ * @geo: cbtree geometry
+ * @key: pointer to key
+ *
+ * The function returns the item right after the value pointed to by @key,
+ * and updates @key with its key, or returns %NULL when there is no entry
+ * with a larger key.
+ *
+ * cbtree_first(), cbtree_last(), cbtree_get_next() and cbtree_get_prev()
+ * remember the entry they returned.  Stepping on from that key without
+ * changing the tree in between follows the leaf links, so a whole walk
+ * costs O(1) per entry instead of a descent per entry.
+ */
+void *cbtree_get_next(struct cbtree_head *head, struct cbtree_geo *geo,
+		     unsigned long *key);
+
+/* longest key of the built-in geometries, in longs */
+#define CBTREE_MAX_KEYLEN	(128 / BITS_PER_LONG)
+
+/**
+ * struct cbtree_iter - position of a range scan
+ *
+ * @geo: geometry of the scanned tree
+ * @leaf: current leaf, %NULL once the scan is over
+ * @pos: slot of the current entry in @leaf
+ * @end: the last key the scan may return
+ */
+struct cbtree_iter {
+	struct cbtree_geo *geo;
+	unsigned long *leaf;
+	int pos;
+	unsigned long end[CBTREE_MAX_KEYLEN];
+};
+
+/**
+ * cbtree_iter_first - start an ascending range scan
+ *
+ * @head: cbtree head
+ * @geo: cbtree geometry
+ * @iter: scan state
+ * @lo: lowest key of the range
+ * @hi: highest key of the range
+ * @key: set to the key of the returned entry
+ *
+ * Returns the entry with the smallest key in [@lo, @hi], or %NULL.  The
+ * scan descends the tree once; cbtree_iter_next() then follows the leaf
+ * links, so a scan over N entries costs O(log n + N).  The tree must not
+ * be modified while a scan is in progress.
+ */
+void *cbtree_iter_first(struct cbtree_head *head, struct cbtree_geo *geo,
+		struct cbtree_iter *iter, unsigned long *lo, unsigned long *hi,
+		unsigned long *key);
+
+/**
+ * cbtree_iter_next - next entry of an ascending range scan
+ *
+ * @iter: scan state set up by cbtree_iter_first()
+ * @key: set to the key of the returned entry
+ *
+ * Returns the entry following the last one returned, or %NULL at the end
+ * of the range.
+ */
+void *cbtree_iter_next(struct cbtree_iter *iter, unsigned long *key);
+
+/**
+ * cbtree_iter_last - start a descending range scan
+ *
+ * @head: cbtree head
+ * @geo: cbtree geometry
+ * @iter: scan state
+ * @lo: lowest key of the range
+ * @hi: highest key of the range
+ * @key: set to the key of the returned entry
+ *
+ * Like cbtree_iter_first(), but starts at the largest key in [@lo, @hi]
+ * and walks down with cbtree_iter_prev().
+ */
+void *cbtree_iter_last(struct cbtree_head *head, struct cbtree_geo *geo,
+		struct cbtree_iter *iter, unsigned long *lo, unsigned long *hi,
+		unsigned long *key);
+
+/**
+ * cbtree_iter_prev - next entry of a descending range scan
+ *
+ * @iter: scan state set up by cbtree_iter_last()
+ * @key: set to the key of the returned entry
+ */
+void *cbtree_iter_prev(struct cbtree_iter *iter, unsigned long *key);
+
+#define cbtree_for_each_range(head, geo, iter, lo, hi, key, val)	\
+	for (val = cbtree_iter_first(head, geo, iter, lo, hi, key);	\
+	     val;							\
+	     val = cbtree_iter_next(iter, key))
+
+#define cbtree_for_each_range_reverse(head, geo, iter, lo, hi, key, val) \
+	for (val = cbtree_iter_last(head, geo, iter, lo, hi, key);	\
+	     val;							\
+	     val = cbtree_iter_prev(iter, key))
+
+
+/**
+ * struct cbtree_stats - node usage of a cbtree
+ *
+ * @height: height of the tree
+ * @nodes: number of nodes
+ * @leaves: number of leaf nodes
+ * @entries: number of entries stored in the leaves
+ * @bytes: memory used by the nodes, their cache queues and the hot-key
+ *	table
+ * @cache_bytes: the part of @bytes taken by the cache queues and the
+ *	hot-key table
+ * @slots: entry slots in the leaves, @entries * 100 / @slots is the leaf fill
+ * @min_fill: fewest entries in a node other than the root
+ */
+struct cbtree_stats {
+	int height;
+	size_t nodes;
+	size_t leaves;
+	size_t entries;
+	size_t bytes;
+	size_t cache_bytes;
+	size_t slots;
+	int min_fill;
+};
+
+/**
+ * cbtree_stats - collect node usage statistics
+ *
+ * @head: cbtree head
+ * @geo: cbtree geometry
+ * @stats: filled with the statistics
+ *
+ * Walks the whole tree, so this is meant for benchmarks and debugging.
+ */
+void cbtree_stats(struct cbtree_head *head, struct cbtree_geo *geo,
+		  struct cbtree_stats *stats);
 
 /* internal use, use cbtree_visitor{l,32,64,128} */
 size_t cbtree_visitor(struct cbtree_head *head, struct cbtree_geo *geo,
@@ -203,6 +761,23 @@ size_t cbtree_grim_visitor(struct cbtree_head *head, struct cbtree_geo *geo,
 				       size_t index, void *func2),
 			  void *func2);
 
+/*
+ * internal use, use cbtree_{lookup,insert,remove}{l,32,64,128}: versions
+ * of cbtree_lookup(), cbtree_insert() and cbtree_remove() compiled for one
+ * built-in geometry.
+ */
+#define CBTREE_DECLARE_SPEC(name)					\
+void *cbtree_lookup_##name(struct cbtree_head *head, unsigned long *key); \
+int __must_check cbtree_insert_##name(struct cbtree_head *head,		\
+				      unsigned long *key, void *val,	\
+				      gfp_t gfp);			\
+void *cbtree_remove_##name(struct cbtree_head *head, unsigned long *key)
+
+CBTREE_DECLARE_SPEC(geo32);
+CBTREE_DECLARE_SPEC(geo32p);
+CBTREE_DECLARE_SPEC(geo64);
+CBTREE_DECLARE_SPEC(geo128);
+
 extern struct kmem_cache *cbtree_cachep;
 
 #include "cbtree-128.h"
@@ -211,9 +786,22 @@ extern struct cbtree_geo cbtree_geo32;
 #define BTREE_TYPE_SUFFIX l
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define NODESIZE MAX(L1_CACHE_BYTES, 128)
+
+/*
+ * Every node is followed by its lookup cache in the same slab object:
+ * CBTREE_CACHE_WAYS keys with the leaves they were found in, the way to
+ * replace next and a byte of policy state per way (struct cbtree_cache).
+ * Slab caches and mempools for nodes of @nodesize bytes need objects of
+ * CBTREE_NODE_BYTES(nodesize).
+ */
+#define CBTREE_CACHE_BYTES						\
+	((CBTREE_CACHE_WAYS * (CBTREE_MAX_KEYLEN + 1) + 1) * sizeof(long) + \
+	 ALIGN(CBTREE_CACHE_WAYS + 1, sizeof(long)))
+#define CBTREE_NODE_BYTES(nodesize)	((nodesize) + CBTREE_CACHE_BYTES)
 #define CBTREE_TYPE_SUFFIX l
 #define CBTREE_TYPE_BITS BITS_PER_LONG
 #define CBTREE_TYPE_GEO &cbtree_geo32
+#define CBTREE_TYPE_SPEC geo32
 #define CBTREE_KEYTYPE unsigned long
 #include "cbtree-type.h"
 
@@ -222,9 +810,31 @@ extern struct cbtree_geo cbtree_geo32;
 	     val;				\
 	     val = cbtree_get_prevl(head, &key))
 
+#define cbtree_for_each_nextl(head, key, val)	\
+	for (val = cbtree_firstl(head, &key);	\
+	     val;				\
+	     val = cbtree_get_nextl(head, &key))
+
+#define cbtree_for_each_rangel(head, iter, lo, hi, key, val)	\
+	for (val = cbtree_iter_firstl(head, iter, lo, hi, &key);	\
+	     val;						\
+	     val = cbtree_iter_nextl(iter, &key))
+
+#define cbtree_for_each_range_reversel(head, iter, lo, hi, key, val)	\
+	for (val = cbtree_iter_lastl(head, iter, lo, hi, &key);		\
+	     val;							\
+	     val = cbtree_iter_prevl(iter, &key))
+
+/*
+ * u32 keys are stored packed, 4 bytes per key instead of one long, which
+ * gives more pairs per node than cbtree_geo32 on 64-bit kernels.  Keys
+ * passed to the generic functions with this geometry must fit in a u32.
+ */
+extern struct cbtree_geo cbtree_geo32p;
 #define CBTREE_TYPE_SUFFIX 32
 #define CBTREE_TYPE_BITS 32
-#define CBTREE_TYPE_GEO &cbtree_geo32
+#define CBTREE_TYPE_GEO &cbtree_geo32p
+#define CBTREE_TYPE_SPEC geo32p
 #define CBTREE_KEYTYPE u32
 #include "cbtree-type.h"
 
@@ -233,10 +843,26 @@ extern struct cbtree_geo cbtree_geo32;
 	     val;				\
 	     val = cbtree_get_prev32(head, &key))
 
+#define cbtree_for_each_next32(head, key, val)	\
+	for (val = cbtree_first32(head, &key);	\
+	     val;				\
+	     val = cbtree_get_next32(head, &key))
+
+#define cbtree_for_each_range32(head, iter, lo, hi, key, val)	\
+	for (val = cbtree_iter_first32(head, iter, lo, hi, &key);	\
+	     val;						\
+	     val = cbtree_iter_next32(iter, &key))
+
+#define cbtree_for_each_range_reverse32(head, iter, lo, hi, key, val)	\
+	for (val = cbtree_iter_last32(head, iter, lo, hi, &key);	\
+	     val;							\
+	     val = cbtree_iter_prev32(iter, &key))
+
 extern struct cbtree_geo cbtree_geo64;
 #define CBTREE_TYPE_SUFFIX 64
 #define CBTREE_TYPE_BITS 64
 #define CBTREE_TYPE_GEO &cbtree_geo64
+#define CBTREE_TYPE_SPEC geo64
 #define CBTREE_KEYTYPE u64
 #include "cbtree-type.h"
 
@@ -245,4 +871,19 @@ extern struct cbtree_geo cbtree_geo64;
 	     val;				\
 	     val = cbtree_get_prev64(head, &key))
 
+#define cbtree_for_each_next64(head, key, val)	\
+	for (val = cbtree_first64(head, &key);	\
+	     val;				\
+	     val = cbtree_get_next64(head, &key))
+
+#define cbtree_for_each_range64(head, iter, lo, hi, key, val)	\
+	for (val = cbtree_iter_first64(head, iter, lo, hi, &key);	\
+	     val;						\
+	     val = cbtree_iter_next64(iter, &key))
+
+#define cbtree_for_each_range_reverse64(head, iter, lo, hi, key, val)	\
+	for (val = cbtree_iter_last64(head, iter, lo, hi, &key);	\
+	     val;							\
+	     val = cbtree_iter_prev64(iter, &key))
+
 #endif
@@ -1,104 +1,152 @@
 #include "cbtree_cache.h"
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
-void initQueue(void* nodep) {
-    Node *curr, *previous = NULL;
-    Node *first = NULL;
-    // printk("%d", nodep);
-    //CircularQueue* q = (CircularQueue*)nodep;
-    CircularQueue* q = kmalloc(sizeof(CircularQueue), GFP_KERNEL);
-    int i; 
-    for (i = 0; i < 4; i++) {
-        curr = kmalloc(sizeof(Node), GFP_KERNEL);
-        // printk("\nnew cache node created %p\n",curr);
-	//check malloc error
-        if (!curr) {
-            // printk(KERN_ERR "Memory allocation failed for node %d\n", i);
-            curr = first;
-            while (curr) {
-                Node *temp = curr->next;
-                kfree(curr);
-                curr = temp;
-            }
-            return;
-        }
+#ifdef CBTREE_CACHE_STATS
+struct cacheCounters {
+    struct cbtree_cache_stats lv[CBTREE_CACHE_LEVELS];
+};
 
-        curr->node = NULL;  
-        curr->next = NULL;
-        curr->key = kmalloc(sizeof(unsigned long) * 2, GFP_KERNEL);
+static DEFINE_PER_CPU(struct cacheCounters, cache_nr);
+static struct dentry *cache_debugfs;
 
-		
+//count @ev in the bucket of @level, the same buckets as cacheWays()
+#define cacheStat(level, ev) \
+    this_cpu_inc(cache_nr.lv[min((level) - 2, CBTREE_CACHE_LEVELS - 1)].ev)
 
-        if (i == 0) {
-            first = curr;
-        } else {
-            previous->next = curr;
-        }
+void cbtree_cache_stats(int level, struct cbtree_cache_stats *stats) {
+    struct cbtree_cache_stats *c;
+    int cpu, lv = min(level - 2, CBTREE_CACHE_LEVELS - 1);
 
-        previous = curr;
+    memset(stats, 0, sizeof(*stats));
+    for_each_possible_cpu(cpu) {
+        c = &per_cpu(cache_nr, cpu).lv[lv];
+        stats->probes += c->probes;
+        stats->hits += c->hits;
+        stats->misses += c->misses;
+        stats->evictions += c->evictions;
+        stats->stale += c->stale;
     }
-    curr->next = first;
-    q->head = first;
-    ((unsigned long*)nodep)[0] = (unsigned long)q;
-    // printk("strat cache node of queue : %p",q->head);
-    // printk("strat cache node of queue : %p",((unsigned long*)nodep)[0]);
-    // printk("*nodep %d", ((unsigned long*)nodep)[0] );
-    // printk("q %d", q);
-    // printk("q-head %d", q->head);
 }
+EXPORT_SYMBOL_GPL(cbtree_cache_stats);
+
+void cbtree_cache_stats_reset(void) {
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(&per_cpu(cache_nr, cpu), 0, sizeof(struct cacheCounters));
+}
+EXPORT_SYMBOL_GPL(cbtree_cache_stats_reset);
 
-void setcache(unsigned long* leaf_node,struct cbtree_head *head, unsigned long * call_node, unsigned long * key, int arr_len, int key_len) {
-	//CircularQueue* q = (CircularQueue*)*nodep;
-    CircularQueue* call_node_queue = (CircularQueue*)((unsigned long*)call_node)[arr_len];
-    //CircularQueue* q = (CircularQueue*)((unsigned long*)call_node_queue)[0];
-    // printk("setcache get %p", leaf_node);
-    //Node* curr = q->head;
-    //printk("set cache call %d",curr->node);
-    if(call_node_queue->head->node != NULL){
-        if(call_node_queue->head->node[arr_len + 1] == 1 && call_node_queue->head->node[arr_len + 2] == 1){ //if this cache is last one witch save that node and node already deleted
-            freeQueue(call_node_queue->head->node,head,arr_len);
-            //mempool_free(call_node_queue->head->node, head->mempool);
-		}
-        else{
-			call_node_queue->head->node[arr_len + 1] -= 1;
-		}
+static int cache_stats_show(struct seq_file *m, void *v) {
+    struct cbtree_cache_stats s;
+    int level;
+
+    seq_printf(m, "level      probes        hits      misses   evictions       stale\n");
+    for (level = 2; level < CBTREE_CACHE_LEVELS + 2; level++) {
+        cbtree_cache_stats(level, &s);
+        seq_printf(m, "%4d%s %11lu %11lu %11lu %11lu %11lu\n", level,
+                level == CBTREE_CACHE_LEVELS + 1 ? "+" : " ",
+                s.probes, s.hits, s.misses, s.evictions, s.stale);
     }
-    leaf_node[arr_len+1] += 1;
-    /*
-	if(curr->node != NULL){
-		if(curr->node[1] == 1 && curr->node[2] == 1){ //if this cache is last one witch save that node and node already deleted
-			mempool_free(curr->node, head->mempool);
-		}
-		else{
-			curr->node[1] -= 1;
-		}
-	}
-    */
-    
-	call_node_queue->head->node = leaf_node;
-	//call_node_queue->head->node[1] += 1;
-    // printk("node added to %p",call_node_queue->head->node);
-    int i;
-	for(i = 0;i <key_len; i++ ){
-        //  printk(" curr->key %d' changed to %d key",call_node_queue->head->key[i],key[i]);
-		call_node_queue->head->key[i] = key[i];
+    seq_printf(m, "bytes per node %zu\n", queueBytes());
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cache_stats);
+
+void cbtree_cache_debugfs_init(void) {
+    cache_debugfs = debugfs_create_dir("cbtree", NULL);
+    debugfs_create_file("cache_stats", 0444, cache_debugfs, NULL,
+            &cache_stats_fops);
+}
+EXPORT_SYMBOL_GPL(cbtree_cache_debugfs_init);
+
+void cbtree_cache_debugfs_exit(void) {
+    debugfs_remove_recursive(cache_debugfs);
+    cache_debugfs = NULL;
+}
+EXPORT_SYMBOL_GPL(cbtree_cache_debugfs_exit);
+#else
+#define cacheStat(level, ev) do { } while (0)
+#endif
+
+//counts the cache fills and hits of this CPU for cacheSample()
+DEFINE_PER_CPU(unsigned int, cacheTick);
+
+//the cache is part of the node's slab object, so there is nothing to allocate
+void initQueue(struct cbtree_cache *q) {
+    BUILD_BUG_ON(sizeof(struct cbtree_cache) > CBTREE_CACHE_BYTES);
+    memset(q, 0, sizeof(*q));
+}
+
+//pick the way a new entry for the cache replaces, by the tree's policy
+static int victimWay(struct cbtree_cache *q, struct cbtree_head *head, int ways) {
+    int way = q->hand % ways, best, i;
+
+    switch (head->cache_policy) {
+    case CBTREE_CACHE_CLOCK:
+        //clear reference bits until a way without one comes up
+        while (q->leaf[way] != NULL && q->use[way]) {
+            q->use[way] = 0;
+            way = (way + 1) % ways;
+        }
+        break;
+    case CBTREE_CACHE_LFU:
+        //fewest hits, ties go to the first way after the hand
+        for (best = way, i = 1; i < ways && q->leaf[best] != NULL; i++) {
+            int w = (way + i) % ways;
+
+            if (q->leaf[w] == NULL || q->use[w] < q->use[best])
+                best = w;
+        }
+        way = best;
+        break;
     }
-    call_node_queue->head = call_node_queue->head->next;
+    q->hand = (way + 1) % ways;
+    return way;
 }
 
-//change node key
-/*
-void setNodekey(CircularQueue* q, unsigned long * key, unsigned long * c_key, int arr_len) {
-    for(int i = 0;i++ ;i <arr_len){
-        key[i] = c_key[i];
+void setcache(unsigned long* leaf_node,struct cbtree_head *head, struct cbtree_cache *q, unsigned long * key, int arr_len, int key_len, int level) {
+    int way, i;
+
+    //entries of an older epoch may point at freed nodes, start over
+    if (q->epoch != head->cache_epoch) {
+        freeQueue(q);
+        q->epoch = head->cache_epoch;
     }
+    way = victimWay(q, head, cacheWays(head, level));
+    if(q->leaf[way] != NULL)
+        cacheStat(level, evictions);
+    q->leaf[way] = leaf_node;
+    for(i = 0;i <key_len; i++ )
+        q->key[way][i] = key[i];
+    //a new entry has to earn its reference bit, but starts with one LFU hit
+    q->use[way] = head->cache_policy == CBTREE_CACHE_LFU;
 }
-*/
 
-void* getNodeValue(void* nodep) {
-    //CircularQueue* q = (CircularQueue*)*nodep;
-    CircularQueue* q = (CircularQueue*)((unsigned long*)nodep)[0];
-    Node* curr = q->head;
-    return curr->node;
+//count a hit on @way for the CLOCK and LFU policies
+static void hitWay(struct cbtree_cache *q, struct cbtree_head *head, int way, int ways) {
+    int i;
+
+    switch (head->cache_policy) {
+    case CBTREE_CACHE_CLOCK:
+        if (!q->use[way])
+            q->use[way] = 1;
+        break;
+    case CBTREE_CACHE_LFU:
+        if (q->use[way] == CACHE_LFU_MAX) {
+            //age the node, so that keys hot long ago lose their ways
+            for (i = 0; i < ways; i++)
+                q->use[i] >>= 1;
+        }
+        q->use[way]++;
+        break;
+    }
+}
+
+void* getNodeValue(struct cbtree_cache *q) {
+    return q->leaf[q->hand % CBTREE_CACHE_WAYS];
 }
 
 
@@ -113,75 +161,48 @@ static int cachelongcmp(const unsigned long *l1, const unsigned long *l2, size_t
 	return 0;
 }
 
-void* findNode(void* nodep, unsigned long* key, struct cbtree_head *head, int arr_len) {
-    //CircularQueue* q = (CircularQueue*)*nodep;
-    CircularQueue* q = (CircularQueue*)((unsigned long*)nodep)[0];
-    // printk("findNode %d", nodep);
-    Node *curr = q->head;
-    // printk("find cache call curr %d",curr);
-    // printk("find cache call curr->next %d",curr->next);
-    
-    int i;
-    for(i = 0; i < 4;i++){
-        if(curr->node != NULL){
-            // printk("search cache queue %d elememt-----------------",i);
-		    if(curr->node[arr_len + 2] == 1){
-		    }
-            else if(cachelongcmp(key, curr->key,arr_len)){
-                // printk("else if called");
-                return curr->node;
-            }
-            //curr = curr->next;
-            //printk("find cache call curr->next %d",curr->next);
-        }
-        curr = curr->next;
-        // printk("find cache call curr->next %d and value %d: ",curr->next, curr->key[0]);
+void* findNode(struct cbtree_cache *q, unsigned long* key, struct cbtree_head *head, int arr_len, int key_len, int level) {
+    int ways = cacheWays(head, level);
+    unsigned long *leaf;
+    int i, way;
 
-    }
-    /*
-    for(i = 0; i < 4;i++){
-        printk("%d",i);
-		if(curr->node[2] == 1){
-            printk("if called");
-			mempool_free(curr->node, head->mempool);
-		}
-        else if(cachelongcmp(key, curr->key,arr_len)){
-            printk("else if called");
-            return curr->node;
+    cacheStat(level, probes);
+    //search from the way written last, with round robin the newest entry
+    for(i = 1; i <= ways;i++){
+        way = (q->hand + ways - i) % ways;
+        leaf = q->leaf[way];
+        //compare the key first, the epoch and the leaf are on another line
+        if(leaf == NULL || cachelongcmp(key, q->key[way], key_len))
+            continue;
+        if (q->epoch != head->cache_epoch)
+            break;
+        //unlinked, but still on the limbo list
+        if (leaf[arr_len + NODE_VERSION] & NODE_RETIRED) {
+            cacheStat(level, stale);
+            continue;
         }
-        q->head = curr->next;
+        //a probe only reads the node, apart from a sample of the hits
+        if (head->cache_policy != CBTREE_CACHE_RR && cacheSample())
+            hitWay(q, head, way, ways);
+        cacheStat(level, hits);
+        return leaf;
     }
-    */
-    //there is no target, move curr position to the next of start point and NULL return
-    q->head = q->head->next;
+    cacheStat(level, misses);
     return NULL;
 }
 
-void freeQueue(void* nodep,struct cbtree_head *head, int arr_len) { //arr_len is the length of orignal node
-    //CircularQueue* q = (CircularQueue*)*nodep;
-    CircularQueue* q = (CircularQueue*)((unsigned long*)nodep)[0];
-    // printk("freequeue %d", nodep);
-    Node *curr = q->head;
-    
-    if (!curr) {
-        return;
-    }
+//start loading the cached keys of a node, before it is searched with findNode
+void prefetchQueue(struct cbtree_cache *q) {
+    prefetch(q->key);
+}
+
+//drop every cached leaf, when the leaves of the node's subtree changed trees
+void freeQueue(struct cbtree_cache *q) {
+    memset(q->leaf, 0, sizeof(q->leaf));
+    memset(q->use, 0, sizeof(q->use));
+}
 
-    Node *first = curr;
-    do {
-        Node *temp = curr;
-        curr = curr->next;
-		if(curr != NULL){
-			if(curr->node[arr_len+1] <= 1 && curr->node[arr_len + 2] == 1){ //if this cache is last one witch save that node and node already deleted
-				freeQueue(curr->node[arr_len],head,arr_len);
-                mempool_free(curr->node, head->mempool);
-			}
-			else{
-				curr->node[1] -= 1;
-			}
-		}
-        kfree(temp->key);
-        kfree(temp);
-    } while (curr != first);
-    kfree(q);
+//memory used by the cache of one node
+size_t queueBytes(void) {
+    return CBTREE_CACHE_BYTES;
 }
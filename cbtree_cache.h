@@ -1,25 +1,76 @@
 #include <linux/slab.h>
 #include <linux/printk.h>
+#include <linux/prefetch.h>
 #include "cbtree_base.h"
 
-typedef struct Node {
-    unsigned long *node;
-    unsigned long *key;
-    struct Node* next;
-} Node;
+/*
+ * Trailer slots, counted from CACHE_START(geo): the version of the node and
+ * the links to the neighbouring leaves (LEAF_NEXT holds the larger keys).
+ * The version has NODE_RETIRED set once the node was unlinked from its tree
+ * and waits on the limbo list.  Writers of CBTREE_RCU trees that lock single
+ * nodes hold NODE_LOCKED while they change one, and then move the version on
+ * by NODE_VERSION_STEP.
+ */
+#define NODE_VERSION	0
+#define LEAF_PREV	1
+#define LEAF_NEXT	2
 
-typedef struct {
-    Node* head;
-} CircularQueue;
+#define NODE_LOCKED		1UL
+#define NODE_RETIRED		2UL
+#define NODE_VERSION_STEP	4UL
 
-void initQueue(void * q);
+/*
+ * The lookup cache of a node, stored right behind its geo->nodesize bytes.
+ * The keys come first so that a probe reads one line for them, @epoch and
+ * the leaf of a matching way are only read on a hit.  The entries are only
+ * valid while @epoch is the tree's cache_epoch.  @hand is where the search
+ * for a way to replace starts, @use the CLOCK bit or LFU counter of each way.
+ */
+struct cbtree_cache {
+    unsigned long key[CBTREE_CACHE_WAYS][CBTREE_MAX_KEYLEN];
+    unsigned long epoch;
+    unsigned long *leaf[CBTREE_CACHE_WAYS];
+    unsigned char hand;
+    unsigned char use[CBTREE_CACHE_WAYS];
+};
 
-void setcache(unsigned long *  q,struct cbtree_head *head, unsigned long * node, unsigned long * key, int arr_len, int key_len);
+//saturation value of the CBTREE_CACHE_LFU counters
+#define CACHE_LFU_MAX	15
 
-void* getNodeValue(void *  q);
+//ways of the cache used by the inner nodes on @level (2 and up)
+static inline int cacheWays(struct cbtree_head *head, int level)
+{
+    int ways = head->cache_ways[min(level - 2, CBTREE_CACHE_LEVELS - 1)];
+
+    return ways && ways < CBTREE_CACHE_WAYS ? ways : CBTREE_CACHE_WAYS;
+}
+
+static inline struct cbtree_cache *nodeCache(unsigned long *node, unsigned int nodesize)
+{
+    return (struct cbtree_cache *)((char *)node + nodesize);
+}
+
+void initQueue(struct cbtree_cache *q);
+
+void setcache(unsigned long *  leaf_node,struct cbtree_head *head, struct cbtree_cache *q, unsigned long * key, int arr_len, int key_len, int level);
+
+void* getNodeValue(struct cbtree_cache *q);
 
 static int cachelongcmp(const unsigned long *l1, const unsigned long *l2, size_t n);
 
-void* findNode(void *  q, unsigned long* key, struct cbtree_head *head, int arr_len);
+void* findNode(struct cbtree_cache *q, unsigned long* key, struct cbtree_head *head, int arr_len, int key_len, int level);
+
+DECLARE_PER_CPU(unsigned int, cacheTick);
+
+//true once in cbtree_cache_fill calls on this CPU, see CBTREE_CACHE_FILL
+static inline bool cacheSample(void)
+{
+    return cbtree_cache_fill <= 1 ||
+        this_cpu_inc_return(cacheTick) % cbtree_cache_fill == 0;
+}
+
+void prefetchQueue(struct cbtree_cache *q);
+
+void freeQueue(struct cbtree_cache *q);
 
-void freeQueue(void *  q,struct cbtree_head *head, int arr_len);
+size_t queueBytes(void);
@@ -0,0 +1,401 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Range-partitioned cbtree: a router over cbtrees that each hold one key
+ * range, see cbtree_shard.h.
+ *
+ * The bounds are read without a lock to pick a shard, and checked again
+ * once its mutex is held: a bound only moves with the shards on both of
+ * its sides locked, so the bounds of a locked shard stay put.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include "cbtree_shard.h"
+
+static inline unsigned long *shard_bound(struct cbtree_sharded_head *sh,
+		unsigned int i)
+{
+	return &sh->bounds[i * sh->geo->keylen];
+}
+
+static int bound_cmp(struct cbtree_sharded_head *sh, unsigned int i,
+		const unsigned long *key)
+{
+	unsigned long *b = shard_bound(sh, i);
+	int n;
+
+	for (n = 0; n < sh->geo->keylen; n++) {
+		if (b[n] != key[n])
+			return b[n] < key[n] ? -1 : 1;
+	}
+	return 0;
+}
+
+/* the last shard whose lower bound is at most @key */
+static unsigned int shard_route(struct cbtree_sharded_head *sh,
+		unsigned long *key)
+{
+	unsigned int seq, lo, hi, mid;
+
+	do {
+		seq = read_seqcount_begin(&sh->bounds_seq);
+		lo = 0;
+		hi = sh->nr - 1;
+		while (lo < hi) {
+			mid = lo + (hi - lo + 1) / 2;
+			if (bound_cmp(sh, mid, key) <= 0)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+	} while (read_seqcount_retry(&sh->bounds_seq, seq));
+	return lo;
+}
+
+static bool shard_holds(struct cbtree_sharded_head *sh, unsigned int i,
+		unsigned long *key)
+{
+	return bound_cmp(sh, i, key) <= 0 &&
+		(i + 1 == sh->nr || bound_cmp(sh, i + 1, key) > 0);
+}
+
+/* lock the shard of @key, a bound that moved meanwhile means another try */
+static struct cbtree_shard *shard_lock(struct cbtree_sharded_head *sh,
+		unsigned long *key)
+{
+	struct cbtree_shard *s;
+	unsigned int i;
+
+	for (;;) {
+		i = shard_route(sh, key);
+		s = &sh->shards[i];
+		mutex_lock(&s->lock);
+		if (shard_holds(sh, i, key))
+			return s;
+		mutex_unlock(&s->lock);
+	}
+}
+
+int cbtree_shard_init(struct cbtree_sharded_head *sh, struct cbtree_geo *geo,
+		unsigned int nr, unsigned long *bounds)
+{
+	unsigned long top = geo->packed ? U32_MAX : ULONG_MAX;
+	unsigned int i;
+	int err;
+
+	if (!nr)
+		return -EINVAL;
+	sh->geo = geo;
+	sh->nr = nr;
+	seqcount_init(&sh->bounds_seq);
+	init_rwsem(&sh->rebalance_sem);
+
+	sh->bounds = kcalloc(nr * geo->keylen, sizeof(long), GFP_KERNEL);
+	if (!sh->bounds)
+		return -ENOMEM;
+	for (i = 1; i < nr; i++) {
+		if (!bounds) {
+			shard_bound(sh, i)[0] = top / nr * i;
+			continue;
+		}
+		memcpy(shard_bound(sh, i), &bounds[(i - 1) * geo->keylen],
+				geo->keylen * sizeof(long));
+		if (bound_cmp(sh, i - 1, shard_bound(sh, i)) >= 0) {
+			err = -EINVAL;
+			goto free_bounds;
+		}
+	}
+
+	sh->shards = kcalloc(nr, sizeof(*sh->shards), GFP_KERNEL);
+	if (!sh->shards) {
+		err = -ENOMEM;
+		goto free_bounds;
+	}
+	for (i = 0; i < nr; i++) {
+		err = cbtree_init(&sh->shards[i].tree);
+		if (err)
+			goto free_shards;
+		mutex_init(&sh->shards[i].lock);
+	}
+	err = cbtree_init(&sh->spare);
+	if (err)
+		goto free_shards;
+	return 0;
+
+free_shards:
+	while (i--)
+		cbtree_destroy(&sh->shards[i].tree);
+	kfree(sh->shards);
+free_bounds:
+	kfree(sh->bounds);
+	return err;
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_init);
+
+void cbtree_shard_destroy(struct cbtree_sharded_head *sh)
+{
+	unsigned int i;
+
+	for (i = 0; i < sh->nr; i++) {
+		cbtree_grim_visitor(&sh->shards[i].tree, sh->geo, 0, NULL, NULL);
+		cbtree_destroy(&sh->shards[i].tree);
+	}
+	cbtree_destroy(&sh->spare);
+	kfree(sh->shards);
+	kfree(sh->bounds);
+	sh->shards = NULL;
+	sh->bounds = NULL;
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_destroy);
+
+void *cbtree_shard_lookup(struct cbtree_sharded_head *sh, unsigned long *key)
+{
+	struct cbtree_shard *s = shard_lock(sh, key);
+	void *val;
+
+	val = cbtree_lookup(&s->tree, sh->geo, key);
+	mutex_unlock(&s->lock);
+	return val;
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_lookup);
+
+int cbtree_shard_insert(struct cbtree_sharded_head *sh, unsigned long *key,
+		void *val, gfp_t gfp)
+{
+	struct cbtree_shard *s = shard_lock(sh, key);
+	int err;
+
+	err = cbtree_insert(&s->tree, sh->geo, key, val, gfp);
+	if (!err)
+		s->entries++;
+	mutex_unlock(&s->lock);
+	return err;
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_insert);
+
+int cbtree_shard_update(struct cbtree_sharded_head *sh, unsigned long *key,
+		void *val)
+{
+	struct cbtree_shard *s = shard_lock(sh, key);
+	int err;
+
+	err = cbtree_update(&s->tree, sh->geo, key, val);
+	mutex_unlock(&s->lock);
+	return err;
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_update);
+
+void *cbtree_shard_remove(struct cbtree_sharded_head *sh, unsigned long *key)
+{
+	struct cbtree_shard *s = shard_lock(sh, key);
+	void *val;
+
+	val = cbtree_remove(&s->tree, sh->geo, key);
+	if (val)
+		s->entries--;
+	mutex_unlock(&s->lock);
+	return val;
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_remove);
+
+/*
+ * Walk from shard to shard, ascending when @up is set, until one has an
+ * entry.  With @seek the walk starts in the shard of @key with the step
+ * from @key, else at the edge shard with its edge entry.  Every rebalance
+ * step bumps bounds_seq with both of its shards locked, so a walk that
+ * sees it unchanged did not visit a shard before and the other after it.
+ */
+static void *shard_walk(struct cbtree_sharded_head *sh, unsigned long *key,
+		bool up, bool seek)
+{
+	unsigned long save[CBTREE_MAX_KEYLEN];
+	struct cbtree_geo *geo = sh->geo;
+	struct cbtree_shard *s;
+	unsigned int seq;
+	int i, step = up ? 1 : -1;
+	bool edge;
+	void *val;
+
+	memcpy(save, key, geo->keylen * sizeof(long));
+	for (;;) {
+		seq = read_seqcount_begin(&sh->bounds_seq);
+		val = NULL;
+		i = seek ? shard_route(sh, key) : up ? 0 : sh->nr - 1;
+		for (edge = !seek; !val && i >= 0 && i < sh->nr; i += step) {
+			s = &sh->shards[i];
+			mutex_lock(&s->lock);
+			if (edge)
+				val = up ? cbtree_first(&s->tree, geo, key) :
+					cbtree_last(&s->tree, geo, key);
+			else
+				val = up ? cbtree_get_next(&s->tree, geo, key) :
+					cbtree_get_prev(&s->tree, geo, key);
+			mutex_unlock(&s->lock);
+			edge = true;
+		}
+		if (!read_seqcount_retry(&sh->bounds_seq, seq))
+			return val;
+		memcpy(key, save, geo->keylen * sizeof(long));
+	}
+}
+
+void *cbtree_shard_first(struct cbtree_sharded_head *sh, unsigned long *key)
+{
+	return shard_walk(sh, key, true, false);
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_first);
+
+void *cbtree_shard_last(struct cbtree_sharded_head *sh, unsigned long *key)
+{
+	return shard_walk(sh, key, false, false);
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_last);
+
+void *cbtree_shard_get_next(struct cbtree_sharded_head *sh, unsigned long *key)
+{
+	return shard_walk(sh, key, true, true);
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_get_next);
+
+void *cbtree_shard_get_prev(struct cbtree_sharded_head *sh, unsigned long *key)
+{
+	return shard_walk(sh, key, false, true);
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_get_prev);
+
+size_t cbtree_shard_range(struct cbtree_sharded_head *sh, unsigned long *lo,
+		unsigned long *hi, unsigned long opaque,
+		void (*func)(void *elem, unsigned long opaque,
+			     unsigned long *key, size_t index, void *func2),
+		void *func2)
+{
+	unsigned long key[CBTREE_MAX_KEYLEN];
+	struct cbtree_iter iter;
+	struct cbtree_shard *s;
+	unsigned int i, last;
+	size_t count = 0;
+	void *val;
+
+	down_read(&sh->rebalance_sem);
+	last = shard_route(sh, hi);
+	for (i = shard_route(sh, lo); i <= last; i++) {
+		s = &sh->shards[i];
+		mutex_lock(&s->lock);
+		cbtree_for_each_range(&s->tree, sh->geo, &iter, lo, hi, key, val)
+			func(val, opaque, key, count++, func2);
+		mutex_unlock(&s->lock);
+	}
+	up_read(&sh->rebalance_sem);
+	return count;
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_range);
+
+static void shard_set_bound(struct cbtree_sharded_head *sh, unsigned int i,
+		unsigned long *key)
+{
+	preempt_disable();
+	write_seqcount_begin(&sh->bounds_seq);
+	memcpy(shard_bound(sh, i), key, sh->geo->keylen * sizeof(long));
+	write_seqcount_end(&sh->bounds_seq);
+	preempt_enable();
+}
+
+/*
+ * Move the @nr largest entries of shard @i to shard @i + 1, both locked:
+ * cut them off into the spare tree, which is then grafted onto the low
+ * edge of the upper shard.
+ */
+static int shard_move_up(struct cbtree_sharded_head *sh, unsigned int i,
+		size_t nr)
+{
+	struct cbtree_shard *lo = &sh->shards[i], *hi = &sh->shards[i + 1];
+	unsigned long key[CBTREE_MAX_KEYLEN];
+	struct cbtree_geo *geo = sh->geo;
+	size_t n;
+	int err;
+
+	if (!cbtree_last(&lo->tree, geo, key))
+		return 0;
+	for (n = 1; n < nr && cbtree_get_prev(&lo->tree, geo, key); n++)
+		;
+	err = cbtree_split(&lo->tree, geo, key, &sh->spare, GFP_KERNEL);
+	if (err)
+		return err;
+	err = cbtree_merge(&hi->tree, &sh->spare, geo, GFP_KERNEL);
+	if (err) {
+		WARN_ON(cbtree_merge(&lo->tree, &sh->spare, geo,
+				GFP_KERNEL | __GFP_NOFAIL));
+		return err;
+	}
+	shard_set_bound(sh, i + 1, key);
+	lo->entries -= n;
+	hi->entries += n;
+	return 1;
+}
+
+/*
+ * Move the @nr smallest entries of shard @i + 1 to shard @i, both locked.
+ * The upper shard keeps its larger entries in the spare tree while the
+ * rest is grafted onto the high edge of the lower shard, and takes them
+ * back in one step, as it is empty by then.
+ */
+static int shard_move_down(struct cbtree_sharded_head *sh, unsigned int i,
+		size_t nr)
+{
+	struct cbtree_shard *lo = &sh->shards[i], *hi = &sh->shards[i + 1];
+	unsigned long key[CBTREE_MAX_KEYLEN];
+	struct cbtree_geo *geo = sh->geo;
+	size_t n;
+	int err;
+
+	/* the smallest entry that stays */
+	if (!cbtree_first(&hi->tree, geo, key))
+		return 0;
+	for (n = 0; n < nr && cbtree_get_next(&hi->tree, geo, key); n++)
+		;
+	if (n < nr)
+		return 0;
+	err = cbtree_split(&hi->tree, geo, key, &sh->spare, GFP_KERNEL);
+	if (err)
+		return err;
+	err = cbtree_merge(&lo->tree, &hi->tree, geo, GFP_KERNEL);
+	if (!err)
+		shard_set_bound(sh, i + 1, key);
+	WARN_ON(cbtree_merge(&hi->tree, &sh->spare, geo,
+			GFP_KERNEL | __GFP_NOFAIL));
+	if (err)
+		return err;
+	lo->entries += n;
+	hi->entries -= n;
+	return 1;
+}
+
+int cbtree_shard_rebalance(struct cbtree_sharded_head *sh)
+{
+	struct cbtree_shard *lo, *hi;
+	int i, moved = 0, ret = 0;
+
+	down_write(&sh->rebalance_sem);
+	for (i = 0; i + 1 < sh->nr && ret >= 0; i++) {
+		lo = &sh->shards[i];
+		hi = &sh->shards[i + 1];
+		mutex_lock(&lo->lock);
+		mutex_lock_nested(&hi->lock, SINGLE_DEPTH_NESTING);
+		if (lo->entries > hi->entries * CBTREE_SHARD_SKEW &&
+		    lo->entries > hi->entries + CBTREE_SHARD_SLACK)
+			ret = shard_move_up(sh, i, (lo->entries - hi->entries) / 2);
+		else if (hi->entries > lo->entries * CBTREE_SHARD_SKEW &&
+			 hi->entries > lo->entries + CBTREE_SHARD_SLACK)
+			ret = shard_move_down(sh, i, (hi->entries - lo->entries) / 2);
+		else
+			ret = 0;
+		if (ret > 0)
+			moved++;
+		mutex_unlock(&hi->lock);
+		mutex_unlock(&lo->lock);
+	}
+	up_write(&sh->rebalance_sem);
+	return ret < 0 ? ret : moved;
+}
+EXPORT_SYMBOL_GPL(cbtree_shard_rebalance);
@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef CBTREE_SHARD_H
+#define CBTREE_SHARD_H
+
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include "cbtree_base.h"
+
+/*
+ * A sharded cbtree splits the key space into ranges, each held by a cbtree
+ * of its own with its own mempool and mutex, so that writers of different
+ * ranges run in parallel.  Shard i holds the keys from its lower bound up
+ * to the lower bound of shard i + 1; the lower bound of shard 0 is zero.
+ * Unlike a hashed split, the shards are in key order, so ordered walks and
+ * range scans go from one shard to the next.
+ *
+ * cbtree_shard_rebalance() moves the bound between two neighbours with
+ * cbtree_split() and cbtree_merge(), which only cut and graft the nodes
+ * along the edge, while the other shards stay in use.
+ */
+
+/* neighbours are evened out when one has more than twice the entries ... */
+#define CBTREE_SHARD_SKEW	2
+/* ... and this many more */
+#define CBTREE_SHARD_SLACK	1024
+
+/**
+ * struct cbtree_shard - one key range of a sharded cbtree
+ *
+ * @tree: the entries of the range
+ * @lock: held around every operation on @tree
+ * @entries: number of entries in @tree
+ */
+struct cbtree_shard {
+	struct cbtree_head tree;
+	struct mutex lock;
+	size_t entries;
+} ____cacheline_aligned_in_smp;
+
+/**
+ * struct cbtree_sharded_head - a cbtree split into key ranges
+ *
+ * @geo: geometry of every shard
+ * @nr: number of shards
+ * @shards: the shards in key order
+ * @bounds: lower bound of every shard, geo->keylen longs each
+ * @bounds_seq: odd while a bound moves, bumped by every rebalance step
+ * @rebalance_sem: taken for writing by cbtree_shard_rebalance(), for
+ *	reading by range scans, which must not see entries change shards
+ * @spare: empty tree that carries the entries moving between two shards
+ */
+struct cbtree_sharded_head {
+	struct cbtree_geo *geo;
+	unsigned int nr;
+	struct cbtree_shard *shards;
+	unsigned long *bounds;
+	seqcount_t bounds_seq;
+	struct rw_semaphore rebalance_sem;
+	struct cbtree_head spare;
+};
+
+/**
+ * cbtree_shard_init - set up a sharded cbtree
+ *
+ * @sh: the sharded head
+ * @geo: the cbtree geometry, one of the shared-slab geometries
+ * @nr: number of shards, at least one
+ * @bounds: lower bounds of shards 1 to @nr - 1, geo->keylen longs each in
+ *	strictly ascending order, or %NULL to spread the shards evenly over
+ *	the key space
+ *
+ * Every shard is set up with cbtree_init(), so that entries can move
+ * between them.  Returns 0, -%EINVAL for bad @nr or @bounds, or -%ENOMEM.
+ */
+int __must_check cbtree_shard_init(struct cbtree_sharded_head *sh,
+		struct cbtree_geo *geo, unsigned int nr, unsigned long *bounds);
+
+/**
+ * cbtree_shard_destroy - free all nodes of a sharded cbtree
+ *
+ * @sh: the sharded head
+ *
+ * The entries themselves are left to the caller, e.g. freed with a
+ * cbtree_shard_range() pass beforehand.
+ */
+void cbtree_shard_destroy(struct cbtree_sharded_head *sh);
+
+/*
+ * Single-key operations, see cbtree_lookup(), cbtree_insert(),
+ * cbtree_update() and cbtree_remove().  Each locks only the shard of @key.
+ */
+void *cbtree_shard_lookup(struct cbtree_sharded_head *sh, unsigned long *key);
+int __must_check cbtree_shard_insert(struct cbtree_sharded_head *sh,
+		unsigned long *key, void *val, gfp_t gfp);
+int cbtree_shard_update(struct cbtree_sharded_head *sh, unsigned long *key,
+		void *val);
+void *cbtree_shard_remove(struct cbtree_sharded_head *sh, unsigned long *key);
+
+/*
+ * Ordered walks across the shards, see cbtree_first(), cbtree_last(),
+ * cbtree_get_next() and cbtree_get_prev().  A walk that overlapped a
+ * rebalance step starts over, so no entry is skipped or seen twice.
+ */
+void *cbtree_shard_first(struct cbtree_sharded_head *sh, unsigned long *key);
+void *cbtree_shard_last(struct cbtree_sharded_head *sh, unsigned long *key);
+void *cbtree_shard_get_next(struct cbtree_sharded_head *sh,
+		unsigned long *key);
+void *cbtree_shard_get_prev(struct cbtree_sharded_head *sh,
+		unsigned long *key);
+
+/**
+ * cbtree_shard_range - visit the entries of a key range in ascending order
+ *
+ * @sh: the sharded head
+ * @lo: lowest key to visit
+ * @hi: highest key to visit
+ * @opaque: passed to @func
+ * @func: called for every entry, with its shard locked
+ * @func2: passed to @func
+ *
+ * Each shard is scanned with its lock held, and no rebalance runs during
+ * the whole scan, so entries do not move between shards under it.
+ * Returns the number of entries visited.
+ */
+size_t cbtree_shard_range(struct cbtree_sharded_head *sh, unsigned long *lo,
+		unsigned long *hi, unsigned long opaque,
+		void (*func)(void *elem, unsigned long opaque,
+			     unsigned long *key, size_t index, void *func2),
+		void *func2);
+
+/**
+ * cbtree_shard_rebalance - even out the entries of neighbouring shards
+ *
+ * @sh: the sharded head
+ *
+ * Goes over the neighbours in key order and moves the bound between two
+ * of them when one holds more than CBTREE_SHARD_SKEW times the entries of
+ * the other and CBTREE_SHARD_SLACK more, so that both end up with about
+ * the same number.  Only the two shards of a step are locked.  A skew
+ * that spans several shards takes several calls to even out.  Sleeps.
+ * Returns the number of bounds moved, or -%ENOMEM.
+ */
+int cbtree_shard_rebalance(struct cbtree_sharded_head *sh);
+
+#endif
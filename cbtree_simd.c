@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * AVX2 in-node search for cbtree geometries with single-long keys.
+ *
+ * Keys are sorted in descending order and the unused tail of a node is
+ * zero, so the slot getpos() looks for equals the number of keys greater
+ * than the probe.  Four keys are compared at once with vpcmpgtq; the sign
+ * bit is flipped first since the compare is signed.  vmovmskpd turns the
+ * result into a bitmask and its popcount is the slot.
+ *
+ * SSE2 has no 64-bit compare, so there is no 128-bit variant; CPUs without
+ * AVX2 and 32-bit kernels use the scalar getpos().
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include "cbtree_simd.h"
+
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#endif
+
+int cbtree_simd_enabled __read_mostly = 1;
+EXPORT_SYMBOL_GPL(cbtree_simd_enabled);
+module_param_named(simd, cbtree_simd_enabled, int, 0644);
+MODULE_PARM_DESC(simd, "use the AVX2 node search in cbtree_lookup_simd");
+
+#ifdef CONFIG_X86_64
+bool cbtree_simd_usable(void)
+{
+	return cbtree_simd_enabled && boot_cpu_has(X86_FEATURE_AVX2) &&
+	       irq_fpu_usable();
+}
+
+/*
+ * The kernel is built without SSE, so GCC never keeps anything in the
+ * vector registers of C code and refuses them as asm clobbers.  Other
+ * builds of this file have them listed.
+ */
+#ifdef __SSE__
+#define SIMD_CLOBBERS	"xmm0", "xmm1", "xmm2",
+#else
+#define SIMD_CLOBBERS
+#endif
+
+int cbtree_simd_getpos(const unsigned long *keys, int no_pairs,
+		       unsigned long key)
+{
+	static const u64 sign = 1ULL << 63;
+	u64 probe = key ^ sign;
+	unsigned long groups = DIV_ROUND_UP(no_pairs, 4);
+	/* the keys of the last group that are inside @no_pairs */
+	unsigned int tail = (1U << (no_pairs - (groups - 1) * 4)) - 1;
+	unsigned int mask;
+	int pos;
+
+	/*
+	 * One asm statement, so that ymm0 and ymm1 hold the broadcast keys
+	 * for the whole loop.  Every AVX2 CPU has popcnt.
+	 */
+	asm volatile("vpbroadcastq %[probe], %%ymm0\n\t"
+		     "vpbroadcastq %[sign], %%ymm1\n\t"
+		     "xor %[pos], %[pos]\n"
+		     "1:\n\t"
+		     "vpxor (%[keys]), %%ymm1, %%ymm2\n\t"
+		     "vpcmpgtq %%ymm0, %%ymm2, %%ymm2\n\t"
+		     "vmovmskpd %%ymm2, %[mask]\n\t"
+		     "add $32, %[keys]\n\t"
+		     "dec %[groups]\n\t"
+		     "jnz 2f\n\t"
+		     "and %[tail], %[mask]\n"
+		     "2:\n\t"
+		     "popcnt %[mask], %[mask]\n\t"
+		     "add %[mask], %[pos]\n\t"
+		     "test %[groups], %[groups]\n\t"
+		     "jnz 1b"
+		     : [pos] "=&r" (pos), [mask] "=&r" (mask),
+		       [keys] "+r" (keys), [groups] "+r" (groups)
+		     : [probe] "m" (probe), [sign] "m" (sign), [tail] "r" (tail)
+		     : SIMD_CLOBBERS "cc", "memory");
+	return pos;
+}
+#else
+bool cbtree_simd_usable(void)
+{
+	return false;
+}
+
+int cbtree_simd_getpos(const unsigned long *keys, int no_pairs,
+		       unsigned long key)
+{
+	int i;
+
+	for (i = 0; i < no_pairs; i++)
+		if (keys[i] <= key)
+			break;
+	return i;
+}
+#endif
+EXPORT_SYMBOL_GPL(cbtree_simd_usable);
+EXPORT_SYMBOL_GPL(cbtree_simd_getpos);
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef CBTREE_SIMD_H
+#define CBTREE_SIMD_H
+
+#include <linux/types.h>
+
+#ifdef CONFIG_X86_64
+#include <asm/fpu/api.h>
+#define cbtree_simd_begin()	kernel_fpu_begin()
+#define cbtree_simd_end()	kernel_fpu_end()
+#else
+#define cbtree_simd_begin()	do { } while (0)
+#define cbtree_simd_end()	do { } while (0)
+#endif
+
+/*
+ * Number of lookups done inside one kernel_fpu_begin()/kernel_fpu_end()
+ * section.  kernel_fpu_begin() disables preemption, so the batch bounds the
+ * latency a vectorized lookup loop adds to the rest of the system.
+ */
+#define CBTREE_SIMD_BATCH	32
+
+/*
+ * Set to zero to force the scalar search in cbtree_lookup_simd(), e.g. to
+ * compare both paths.  Ignored on CPUs without AVX2.
+ */
+extern int cbtree_simd_enabled;
+
+/**
+ * cbtree_simd_usable - check whether the vectorized node search can be used
+ *
+ * Returns true if the CPU supports AVX2, cbtree_simd_enabled is set and the
+ * FPU may be used in the current context.
+ */
+bool cbtree_simd_usable(void);
+
+/**
+ * cbtree_simd_getpos - vectorized getpos() for single-long keys
+ *
+ * @keys: key array of a node, sorted in descending order, zero-padded
+ * @no_pairs: number of keys in the node
+ * @key: the key to look for
+ *
+ * Returns the first slot whose key is smaller than or equal to @key, which
+ * is the number of keys greater than @key.  Reads up to three longs past
+ * @no_pairs, which must still be inside the node.  Must be called between
+ * kernel_fpu_begin() and kernel_fpu_end().
+ */
+int cbtree_simd_getpos(const unsigned long *keys, int no_pairs,
+		       unsigned long key);
+
+#endif